@@ -957,6 +957,19 @@ void clear(void *obj) {
     pthread_rwlock_unlock(&rwlock);
 }
 
+int iter_prefix(void *obj, const char *prefix, int prefix_len,
+        iter_callback cb, void *data) {
+    art_tree *tree = obj;
+
+    pthread_rwlock_rdlock(&rwlock);
+
+    int ret = art_iter_prefix(tree, (char *)prefix, prefix_len, cb, data);
+
+    pthread_rwlock_unlock(&rwlock);
+
+    return ret;
+}
+
 // Recursively destroys the tree
 void fill_depth(art_node *n, int depth, int *out, int outsize) {
     // Break if null
@@ -1,10 +1,10 @@
-
 #include "tree.h"
 #include "helper.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 struct hash_entry {
     RB_ENTRY(hash_entry) entries;
@@ -18,6 +18,7 @@ int hash_cmp(struct hash_entry *h1, struct hash_entry *h2) {
 
 struct hash_root {
     RB_HEAD(hash_head, hash_entry) head;
+    pthread_rwlock_t lock;
 };
 
 RB_PROTOTYPE(hash_head, hash_entry, entries, hash_cmp);
@@ -25,12 +26,22 @@ RB_GENERATE(hash_head, hash_entry, entries, hash_cmp);
 
 void* init(void) {
     struct hash_root *root = malloc(sizeof(struct hash_root));
+    RB_INIT(&root->head);
+    pthread_rwlock_init(&root->lock, NULL);
     return root;
 }
 
+static struct hash_entry *lookup(struct hash_root *root, const char *key) {
+    struct hash_entry find;
+    find.key = key;
+    return RB_FIND(hash_head, &root->head, &find);
+}
+
 int add(void *obj, const char *key, void *val) {
     struct hash_root *root = obj;
-    if(find(obj, key)) {
+    pthread_rwlock_wrlock(&root->lock);
+    if(lookup(root, key)) {
+        pthread_rwlock_unlock(&root->lock);
         return 1;
     }
 
@@ -41,29 +52,40 @@ int add(void *obj, const char *key, void *val) {
     strcpy((char *)entry->key, key);
 
     RB_INSERT(hash_head, &root->head, entry);
+    pthread_rwlock_unlock(&root->lock);
     return 0;
 }
 
 void* find(void *obj, const char *key) {
     struct hash_root *root = obj;
-    struct hash_entry *out, find;
-    find.key = key;
-
-    out = RB_FIND(hash_head, &root->head, &find);
-    if(!out) {
-        return NULL;
-    }
-    return out->value;
+    pthread_rwlock_rdlock(&root->lock);
+    struct hash_entry *out = lookup(root, key);
+    void *value = out ? out->value : NULL;
+    pthread_rwlock_unlock(&root->lock);
+    return value;
 }
 
 int del(void *obj, const char *key) {
-    return 0;
+    struct hash_root *root = obj;
+    pthread_rwlock_wrlock(&root->lock);
+    struct hash_entry *out = lookup(root, key);
+    int ret = 1;
+    if(out) {
+        RB_REMOVE(hash_head, &root->head, out);
+        free(out);
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&root->lock);
+    return ret;
 }
 
 void clear(void *obj) {
     struct hash_root *root = obj;
     struct hash_entry *entry, *tmp;
+    pthread_rwlock_wrlock(&root->lock);
     RB_FOREACH_SAFE(entry, hash_head, &root->head, tmp) {
         free(entry);
     }
+    RB_INIT(&root->head);
+    pthread_rwlock_unlock(&root->lock);
 }
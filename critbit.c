@@ -5,227 +5,3539 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "slab.h"
+#include "ebr.h"
+#include "succinct.h"
+
+#define CRITBIT_STATS_DEPTHS 64
 
 typedef struct critbit_root {
     void *head;
 
+#ifndef CRITBIT_MALLOC
+    slab_pool nodes;
+    slab_arena leaves;
+#endif
+
+    // writers are serialized, readers only announce an epoch
     pthread_mutex_t wlock;
-    pthread_rwlock_t left_lock, right_lock;
-    pthread_rwlock_t *cur_rwlock, *prev_rwlock;
+    ebr_limbo limbo;
+    size_t reclaim_batch;
+
+    // the allocator is shared between writers and the reclaimer thread
+    pthread_mutex_t alloc_lock;
+    pthread_t reclaimer;
+    pthread_cond_t reclaim_cond;
+    int reclaimer_running, reclaimer_stop;
+
+    // bumped on every change, lets cursors detect a stale path
+    unsigned long version;
+
+    // kept up to date by every change, for critbit_stats. the depth of a
+    // key is counted when it's inserted and uncounted when it's deleted
+    size_t key_count, node_count, leaf_bytes;
+    long depths[CRITBIT_STATS_DEPTHS];
+
+    // open snapshots, oldest first. while there are any, writers copy
+    // paths under wlock, and what they replace waits in superseded until
+    // no snapshot taken before that can see it any more
+    struct critbit_view *snapshots;
+    volatile int nsnapshots;
+    unsigned long generation;
+    struct superseded *superseded;
+    size_t nsuperseded, superseded_first, superseded_cap;
 } critbit_root;
 
 #include "critbit_common.h"
 
+#define RECLAIM_BATCH 64
+
 critbit_root *critbit_new(void) {
     critbit_root *root = malloc(sizeof(critbit_root));
     root->head = NULL;
 
+#ifndef CRITBIT_MALLOC
+    slab_init(&root->nodes, sizeof(critbit_node));
+    slab_arena_init(&root->leaves);
+#endif
+
     root->wlock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
-    root->left_lock = (pthread_rwlock_t)PTHREAD_RWLOCK_INITIALIZER;
-    root->right_lock = (pthread_rwlock_t)PTHREAD_RWLOCK_INITIALIZER;
+    ebr_limbo_init(&root->limbo);
+    root->reclaim_batch = RECLAIM_BATCH;
+
+    root->alloc_lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    root->reclaim_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    root->reclaimer_running = 0;
+    root->reclaimer_stop = 0;
+
+    root->version = 0;
+
+    root->key_count = 0;
+    root->node_count = 0;
+    root->leaf_bytes = 0;
+    memset(root->depths, 0, sizeof(root->depths));
 
-    root->cur_rwlock = &root->left_lock;
-    root->prev_rwlock = &root->right_lock;
+    root->snapshots = NULL;
+    root->nsnapshots = 0;
+    root->generation = 0;
+    root->superseded = NULL;
+    root->nsuperseded = 0;
+    root->superseded_first = 0;
+    root->superseded_cap = 0;
 
     return root;
 }
 
-static int critbit_insert_inplace(critbit_root *root,
-        const char *key, int keylen, const void* value) {
-    const uint8_t *bytes = (void *)key;
+// counter updates, safe against concurrent writers
+static inline void count_key(critbit_root *root, int depth, long delta) {
+    if(depth >= CRITBIT_STATS_DEPTHS)
+        depth = CRITBIT_STATS_DEPTHS - 1;
+    __sync_fetch_and_add(&root->key_count, delta);
+    __sync_fetch_and_add(&root->depths[depth], delta);
+}
 
-    uint8_t *p = root->head;
-    if(!p) {
-        p = alloc_string(key, keylen, value);
-        if(!p)
-            return 1;
+static inline void count_leaf(critbit_root *root, void *leaf, long sign) {
+    if(!IS_INLINE(leaf))
+        __sync_fetch_and_add(&root->leaf_bytes, sign * LEAF_SIZE(((critbit_leaf *)leaf)->len));
+}
 
-        root->head = p;
+#ifdef CRITBIT_COUNTED
+// keys in the subtree at p
+static inline size_t subtree_count(void *p) {
+    if(!p)
         return 0;
+    return IS_INTERNAL(p) ? ((critbit_node *)TO_NODE(p))->count : 1;
+}
+#endif
+
+// Nodes and leaves reachable from the head stay valid between these two
+static inline void read_begin(critbit_root *root) {
+    ebr_enter();
+}
+
+static inline void read_end(critbit_root *root) {
+    ebr_exit();
+}
+
+// retired items are leaves, or nodes tagged the same way as child pointers
+static void reclaim_item(void *ctx, void *p) {
+    critbit_root *root = ctx;
+    if(IS_INTERNAL(p))
+        free_node(root, TO_NODE(p));
+    else
+        free_leaf(root, p);
+}
+
+// called under wlock once p is unreachable from the head
+static void retire(critbit_root *root, void *p) {
+    if(ebr_retire(&root->limbo, p)) {
+        // out of memory for the limbo list, fall back to waiting
+        ebr_synchronize();
+        pthread_mutex_lock(&root->alloc_lock);
+        reclaim_item(root, p);
+        pthread_mutex_unlock(&root->alloc_lock);
+    }
+    if(root->limbo.pending < root->reclaim_batch)
+        return;
+
+    if(root->reclaimer_running) {
+        pthread_cond_signal(&root->reclaim_cond);
+        return;
     }
 
-    p = find_nearest(root->head, bytes, keylen);
+    // piggyback on the writer, this never waits for readers
+    pthread_mutex_lock(&root->alloc_lock);
+    ebr_collect(&root->limbo, reclaim_item, root);
+    pthread_mutex_unlock(&root->alloc_lock);
+}
+
+static void *reclaimer_main(void *arg) {
+    critbit_root *root = arg;
 
-    uint32_t newbyte;
-    uint8_t newotherbits;
-    for(newbyte = 0; newbyte < keylen; ++newbyte) {
-        if(p[newbyte] != bytes[newbyte]) {
-            newotherbits = p[newbyte] ^ bytes[newbyte];
-            goto found;
+    pthread_mutex_lock(&root->wlock);
+    while(!root->reclaimer_stop) {
+        if(root->limbo.pending < root->reclaim_batch) {
+            pthread_cond_wait(&root->reclaim_cond, &root->wlock);
+            continue;
         }
+
+        ebr_limbo batch;
+        ebr_limbo_move(&root->limbo, &batch);
+        pthread_mutex_unlock(&root->wlock);
+
+        // writers carry on while we wait for the readers
+        ebr_synchronize();
+
+        pthread_mutex_lock(&root->alloc_lock);
+        ebr_limbo_destroy(&batch, reclaim_item, root);
+        pthread_mutex_unlock(&root->alloc_lock);
+
+        pthread_mutex_lock(&root->wlock);
     }
-    if(p[newbyte]) {
-        newotherbits = p[newbyte];
-        goto found;
+    pthread_mutex_unlock(&root->wlock);
+
+    return NULL;
+}
+
+void critbit_set_reclaim_batch(critbit_root *root, size_t batch) {
+    pthread_mutex_lock(&root->wlock);
+    root->reclaim_batch = batch ? batch : 1;
+    pthread_cond_signal(&root->reclaim_cond);
+    pthread_mutex_unlock(&root->wlock);
+}
+
+int critbit_start_reclaimer(critbit_root *root) {
+    pthread_mutex_lock(&root->wlock);
+    int ret = 0;
+    if(!root->reclaimer_running) {
+        root->reclaimer_stop = 0;
+        ret = pthread_create(&root->reclaimer, NULL, reclaimer_main, root) ? 1 : 0;
+        root->reclaimer_running = !ret;
     }
-    return 1;
+    pthread_mutex_unlock(&root->wlock);
 
-found:
-    while(newotherbits & (newotherbits - 1)) {
-        newotherbits &= newotherbits - 1;
+    return ret;
+}
+
+static void stop_reclaimer(critbit_root *root) {
+    pthread_mutex_lock(&root->wlock);
+    int running = root->reclaimer_running;
+    root->reclaimer_stop = 1;
+    pthread_cond_signal(&root->reclaim_cond);
+    pthread_mutex_unlock(&root->wlock);
+
+    if(running)
+        pthread_join(root->reclaimer, NULL);
+    root->reclaimer_running = 0;
+}
+
+// Slots visited by a descent, with the values that were read from them
+#define TRAIL_INLINE 64
+
+typedef struct trail_entry {
+    void **slot;
+    void *value;
+} trail_entry;
+
+typedef struct critbit_trail {
+    trail_entry *entries;
+    int depth, cap;
+    trail_entry inline_entries[TRAIL_INLINE];
+} critbit_trail;
+
+static void trail_init(critbit_trail *trail) {
+    trail->entries = trail->inline_entries;
+    trail->depth = 0;
+    trail->cap = TRAIL_INLINE;
+}
+
+static int trail_push(critbit_trail *trail, void **slot, void *value) {
+    if(trail->depth == trail->cap) {
+        int cap = trail->cap * 2;
+        trail_entry *entries = trail->entries == trail->inline_entries ?
+            malloc(cap * sizeof(trail_entry)) :
+            realloc(trail->entries, cap * sizeof(trail_entry));
+        if(!entries)
+            return 1;
+        if(trail->entries == trail->inline_entries)
+            memcpy(entries, trail->inline_entries, sizeof(trail->inline_entries));
+        trail->entries = entries;
+        trail->cap = cap;
     }
-    newotherbits ^= 0xFF;
-    uint8_t c = p[newbyte];
-    int newdirection = (1 + (newotherbits | c)) >> 8;
+    trail->entries[trail->depth].slot = slot;
+    trail->entries[trail->depth].value = value;
+    ++trail->depth;
+    return 0;
+}
 
-    struct critbit_node *node = alloc_aligned(sizeof(struct critbit_node));
-    if(!node)
-        return 1;
+static void trail_destroy(critbit_trail *trail) {
+    if(trail->entries != trail->inline_entries)
+        free(trail->entries);
+}
 
-    char *x = alloc_string(key, keylen, value);
-    if(!x) {
-        free(node);
-        return 1;
+// What an insert does about the key. The value is either given or made by
+// make once it's known that the key is missing.
+typedef struct insert_op {
+    const void *value;
+    critbit_make_value make;
+    void *data;
+    // whether an existing key gets the new value
+    int replace;
+    // the value the key had, if it was there
+    void *old;
+} insert_op;
+
+enum {
+    UPDATE_CAS,
+    UPDATE_ADD,
+    UPDATE_EXCHANGE,
+};
+
+// Writes while snapshots are open. Nothing a snapshot can see is changed:
+// the path from the head down to the change is copied and the copy is
+// published with a new head, all under wlock. Lock-free writers check for
+// snapshots under reader protection and take this path instead.
+typedef struct superseded {
+    void *p;
+    unsigned long generation;
+} superseded;
+
+// p is no longer in the tree. snapshots up to the current generation may
+// still see it
+static void snapshot_retire(critbit_root *root, void *p) {
+    if(root->nsuperseded == root->superseded_cap && root->superseded_first) {
+        // drop what was already handed on before growing
+        size_t first = root->superseded_first;
+        memmove(root->superseded, root->superseded + first,
+                (root->nsuperseded - first) * sizeof(superseded));
+        root->nsuperseded -= first;
+        root->superseded_first = 0;
+    }
+    if(root->nsuperseded == root->superseded_cap) {
+        size_t cap = root->superseded_cap ? root->superseded_cap * 2 : 256;
+        superseded *items = realloc(root->superseded, cap * sizeof(superseded));
+        // nowhere to keep it, leaking is the only safe choice
+        if(!items)
+            return;
+        root->superseded = items;
+        root->superseded_cap = cap;
     }
+    root->superseded[root->nsuperseded].p = p;
+    root->superseded[root->nsuperseded].generation = root->generation;
+    ++root->nsuperseded;
+}
 
-    node->byte = newbyte;
-    node->otherbits = newotherbits;
-    node->child[1 - newdirection] = x;
+static void retire_leaf(critbit_root *root, void *leaf) {
+    if(IS_INLINE(leaf))
+        return;
+    if(root->nsnapshots)
+        snapshot_retire(root, leaf);
+    else
+        retire(root, leaf);
+}
 
-    void **wherep = &root->head;
-    for(;;) {
-        uint8_t *p = *wherep;
+// descends to the leaf for key, recording the path. returns the leaf or
+// NULL for an empty tree, -1 in ret if out of memory
+static void *trail_descend(critbit_root *root, critbit_trail *trail,
+        const uint8_t *bytes, size_t keylen, int *ret) {
+    void **slot = &root->head;
+    void *p = *slot;
+    trail->depth = 0;
+    *ret = 0;
+    while(p) {
+        if(trail_push(trail, slot, p)) {
+            *ret = -1;
+            return NULL;
+        }
         if(!IS_INTERNAL(p))
             break;
 
-        struct critbit_node *q = TO_NODE(p);
-        if(q->byte > newbyte)
-            break;
-        if(q->byte == newbyte && q->otherbits > newotherbits)
-            break;
+        critbit_node *q = TO_NODE(p);
+        slot = q->child + get_direction(q, bytes, keylen);
+        p = *slot;
+    }
+    return p;
+}
+
+// publishes a copy of the path down to trail entry depth, which is
+// replaced by w. returns 1 if out of memory
+static int path_publish(critbit_root *root, critbit_trail *trail, int depth, void *w) {
+    int i;
+    for(i = depth - 1; i >= 0; i--) {
+        critbit_node *node = TO_NODE(trail->entries[i].value);
+        int dir = trail->entries[i + 1].slot == &node->child[1];
+
+        pthread_mutex_lock(&root->alloc_lock);
+        critbit_node *copy = alloc_node(root);
+        pthread_mutex_unlock(&root->alloc_lock);
+        if(!copy)
+            goto fail;
 
-        wherep = q->child + get_direction(q, bytes, keylen);
+        copy->byte = node->byte;
+        copy->otherbits = node->otherbits;
+        copy->child[1 - dir] = CHILD(node, 1 - dir);
+        copy->child[dir] = w;
+#ifdef CRITBIT_COUNTED
+        copy->count = subtree_count(copy->child[0]) + subtree_count(copy->child[1]);
+#endif
+        w = FROM_NODE(copy);
     }
-    node->child[newdirection] = *wherep;
-    __sync_synchronize();
-    *wherep = FROM_NODE(node);
+
     __sync_synchronize();
+    root->head = w;
+    __sync_fetch_and_add(&root->version, 1);
 
+    for(i = 0; i < depth; i++) {
+        snapshot_retire(root, trail->entries[i].value);
+    }
     return 0;
+
+fail:
+    // free the copies made so far, from the top down
+    pthread_mutex_lock(&root->alloc_lock);
+    for(i++; i < depth; i++) {
+        critbit_node *copy = TO_NODE(w);
+        critbit_node *node = TO_NODE(trail->entries[i].value);
+        w = copy->child[trail->entries[i + 1].slot == &node->child[1]];
+        free_node(root, copy);
+    }
+    pthread_mutex_unlock(&root->alloc_lock);
+    return 1;
 }
 
-int critbit_insert(critbit_root *root, const char *key, const void* value) {
-    const size_t len = strlen(key);
+static void free_unpublished(critbit_root *root, critbit_node *node, void *leaf) {
+    pthread_mutex_lock(&root->alloc_lock);
+    if(node)
+        free_node(root, node);
+    if(leaf)
+        free_leaf(root, leaf);
+    pthread_mutex_unlock(&root->alloc_lock);
+}
+
+static void *make_leaf(critbit_root *root, const uint8_t *bytes, size_t keylen,
+        const void *value) {
+    pthread_mutex_lock(&root->alloc_lock);
+    void *x = new_leaf(root, bytes, keylen, value);
+    pthread_mutex_unlock(&root->alloc_lock);
+    return x;
+}
+
+static int snapshot_insert(critbit_root *root,
+        const uint8_t *bytes, size_t keylen, insert_op *op) {
+    critbit_trail trail;
+    trail_init(&trail);
+    critbit_node *node = NULL;
+    void *x = NULL;
+    int ret;
 
     pthread_mutex_lock(&root->wlock);
-    int ret = critbit_insert_inplace(root, key, len, value);
-    pthread_mutex_unlock(&root->wlock);
+    void *p = trail_descend(root, &trail, bytes, keylen, &ret);
+    if(ret)
+        goto out;
 
-    return ret;
-}
+    leaf_view leaf;
+    uint32_t newbyte = 0, newotherbits = 0;
+    int exists = 0;
+    if(p) {
+        leaf_load(&leaf, p);
+        exists = key_critbit(leaf.key, leaf.len, bytes, keylen, &newbyte, &newotherbits);
+        if(exists) {
+            op->old = leaf.value;
+            ret = 1;
+            if(!op->replace)
+                goto out;
+        }
+    }
 
-static void * critbit_delete_inplace(critbit_root *root, const char *key, int keylen) {
-    if(!root->head) return NULL;
+    if(op->make)
+        op->value = op->make(op->data, (const char *)bytes, keylen);
+    ret = -1;
+    x = make_leaf(root, bytes, keylen, op->value);
+    if(!x)
+        goto out;
 
-    const uint8_t *bytes = (void *)key;
-    uint8_t *p = root->head;
-    void **wherep = &root->head, **whereq = 0;
-    critbit_node *q = NULL;
-    int dir = 0;
+    if(!p) {
+        __sync_synchronize();
+        root->head = x;
+        __sync_fetch_and_add(&root->version, 1);
+        count_key(root, 0, 1);
+        count_leaf(root, x, 1);
+        x = NULL;
+        ret = 0;
+        goto out;
+    }
 
-    while(IS_INTERNAL(p)) {
-        whereq = wherep;
-        q = TO_NODE(p);
-        dir = get_direction(q, bytes, keylen);
-        wherep = q->child + dir;
-        p = *wherep;
+    if(exists) {
+        if(path_publish(root, &trail, trail.depth - 1, x))
+            goto out;
+        count_leaf(root, p, -1);
+        count_leaf(root, x, 1);
+        retire_leaf(root, p);
+        x = NULL;
+        ret = 1;
+        goto out;
     }
 
-    if(strcmp(key, (const char *)p) != 0) {
-        return NULL;
+    int i;
+    for(i = 0; i < trail.depth - 1; i++) {
+        critbit_node *q = TO_NODE(trail.entries[i].value);
+        if(!crit_before(q->byte, q->otherbits, newbyte, newotherbits))
+            break;
     }
 
-    if(!whereq) {
+    pthread_mutex_lock(&root->alloc_lock);
+    node = alloc_node(root);
+    pthread_mutex_unlock(&root->alloc_lock);
+    if(!node)
+        goto out;
+
+    int newdirection = key_direction(newbyte, newotherbits, leaf.key, leaf.len);
+    node->byte = newbyte;
+    node->otherbits = newotherbits;
+    node->child[newdirection] = trail.entries[i].value;
+    node->child[1 - newdirection] = x;
+#ifdef CRITBIT_COUNTED
+    node->count = subtree_count(trail.entries[i].value) + 1;
+#endif
+    if(path_publish(root, &trail, i, FROM_NODE(node)))
+        goto out;
+
+    count_key(root, i + 1, 1);
+    count_leaf(root, x, 1);
+    __sync_fetch_and_add(&root->node_count, 1);
+    node = NULL;
+    x = NULL;
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&root->wlock);
+    trail_destroy(&trail);
+    free_unpublished(root, node, x);
+    return ret;
+}
+
+static int snapshot_update(critbit_root *root, const uint8_t *bytes, size_t keylen,
+        int kind, void *expected, void *arg, void **old) {
+    critbit_trail trail;
+    trail_init(&trail);
+    void *x = NULL;
+    int ret;
+
+    pthread_mutex_lock(&root->wlock);
+    void *p = trail_descend(root, &trail, bytes, keylen, &ret);
+    ret = 1;
+    if(!p || !leaf_matches(p, bytes, keylen))
+        goto out;
+
+    void *cur = leaf_value(p), *value = arg;
+    *old = cur;
+    if(kind == UPDATE_CAS && cur != expected)
+        goto out;
+    if(kind == UPDATE_ADD)
+        value = (void *)((size_t)cur + (size_t)arg);
+
+    x = make_leaf(root, bytes, keylen, value);
+    if(!x || path_publish(root, &trail, trail.depth - 1, x))
+        goto out;
+
+    count_leaf(root, p, -1);
+    count_leaf(root, x, 1);
+    retire_leaf(root, p);
+    x = NULL;
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&root->wlock);
+    trail_destroy(&trail);
+    free_unpublished(root, NULL, x);
+    return ret;
+}
+
+// called under wlock. returns 0 if the key was deleted
+static int snapshot_delete(critbit_root *root, const uint8_t *bytes, size_t keylen) {
+    critbit_trail trail;
+    trail_init(&trail);
+
+    int ret;
+    void *p = trail_descend(root, &trail, bytes, keylen, &ret);
+    ret = 1;
+    if(!p || !leaf_matches(p, bytes, keylen))
+        goto out;
+
+    int depth = trail.depth - 1;
+    if(!depth) {
+        __sync_synchronize();
         root->head = NULL;
-        return p;
+        __sync_fetch_and_add(&root->version, 1);
+    } else {
+        // the parent goes, its slot gets the sibling
+        critbit_node *q = TO_NODE(trail.entries[depth - 1].value);
+        int dir = trail.entries[depth].slot == &q->child[1];
+        if(path_publish(root, &trail, depth - 1, CHILD(q, 1 - dir)))
+            goto out;
+        snapshot_retire(root, FROM_NODE(q));
+        __sync_fetch_and_sub(&root->node_count, 1);
     }
 
-    *whereq = q->child[1 - dir];
-    __sync_synchronize();
-    return FROM_NODE(q);
+    count_key(root, depth, -1);
+    count_leaf(root, p, -1);
+    retire_leaf(root, p);
+    ret = 0;
+
+out:
+    trail_destroy(&trail);
+    return ret;
 }
 
-int critbit_delete(critbit_root *root, const char *key) {
-    const size_t len = strlen(key);
+// Inserts don't take wlock. A single descent records every slot on the
+// path, then the new node is published with a CAS on the slot above which
+// it belongs. If anything changed there in the meantime the CAS fails and
+// we start over. A marked slot belongs to a node being deleted, we wait
+// for the delete to unlink it. An existing key gets its new value as in
+// critbit_exchange_value. With CRITBIT_COUNTED the counts on the path have
+// to follow the insert, so inserts take wlock like deletes do and the CAS
+// can't fail.
+// returns 0 if the key was inserted, 1 if it was there, -1 if out of memory
+static int critbit_insert_cas(critbit_root *root,
+        const uint8_t *bytes, size_t keylen, insert_op *op) {
+    critbit_trail trail;
+    trail_init(&trail);
 
-    // begin critical section
+    critbit_node *node = NULL;
+    void *x = NULL;
+    int ret = -1, used = 0, published = 0;
+
+#ifdef CRITBIT_COUNTED
+    // taken before read_begin, critbit_snapshot waits for readers under it
     pthread_mutex_lock(&root->wlock);
+#endif
+    read_begin(root);
+    if(root->nsnapshots) {
+        read_end(root);
+#ifdef CRITBIT_COUNTED
+        pthread_mutex_unlock(&root->wlock);
+#endif
+        return snapshot_insert(root, bytes, keylen, op);
+    }
+    for(;;) {
+        trail.depth = 0;
+        void **slot = &root->head;
+        void *p = *slot;
+        while(p) {
+            if(trail_push(&trail, slot, p))
+                goto out;
+            if(!IS_INTERNAL(p))
+                break;
+
+            critbit_node *q = TO_NODE(p);
+            slot = q->child + get_direction(q, bytes, keylen);
+            p = *slot;
+        }
 
-    void * p = critbit_delete_inplace(root, key, len);
+        leaf_view leaf;
+        uint32_t newbyte = 0, newotherbits = 0;
+        int exists = 0;
+        if(p) {
+            leaf_load(&leaf, p);
+            exists = key_critbit(leaf.key, leaf.len, bytes, keylen, &newbyte, &newotherbits);
+            if(exists && !op->replace) {
+                op->old = leaf.value;
+                ret = 1;
+                goto out;
+            }
+            if(exists && !IS_INLINE(p)) {
+                critbit_leaf *l = UNMARK(p);
+                op->old = __atomic_exchange_n(&l->value, (void *)op->value, __ATOMIC_SEQ_CST);
+                ret = 1;
+                goto out;
+            }
+        }
+
+        if(!x) {
+            if(op->make) {
+                op->value = op->make(op->data, (const char *)bytes, keylen);
+                op->make = NULL;
+            }
+            if(inline_fits(keylen, op->value)) {
+                x = inline_leaf(bytes, keylen, op->value);
+            } else {
+                pthread_mutex_lock(&root->alloc_lock);
+                x = alloc_leaf(root, bytes, keylen, op->value);
+                pthread_mutex_unlock(&root->alloc_lock);
+                if(!x)
+                    goto out;
+            }
+        }
+
+        if(!p) {
+            if(__sync_bool_compare_and_swap(&root->head, NULL, x)) {
+                count_key(root, 0, 1);
+                count_leaf(root, x, 1);
+                published = 1;
+                ret = 0;
+                goto out;
+            }
+            continue;
+        }
+
+        if(exists) {
+            // the value is in the child word, swap the whole word. a marked
+            // leaf is being deleted, let the delete finish first
+            if(IS_MARKED(p)) {
+                sched_yield();
+                continue;
+            }
+            if(__sync_bool_compare_and_swap(slot, p, x)) {
+                count_leaf(root, x, 1);
+                op->old = leaf.value;
+                published = 1;
+                ret = 1;
+                goto out;
+            }
+            continue;
+        }
+
+        int newdirection = key_direction(newbyte, newotherbits, leaf.key, leaf.len);
 
-    pthread_rwlock_t *lock = root->cur_rwlock;
-    pthread_rwlock_t *newlock = root->prev_rwlock;
+        // the new node goes above the first subtree which doesn't test an
+        // earlier bit, the leaf at the end of the trail at the latest
+        int i;
+        for(i = 0; i < trail.depth - 1; i++) {
+            critbit_node *q = TO_NODE(trail.entries[i].value);
+            if(q->byte > newbyte)
+                break;
+            if(q->byte == newbyte && q->otherbits > newotherbits)
+                break;
+        }
+
+        void *old = trail.entries[i].value;
+        if(IS_MARKED(old)) {
+            sched_yield();
+            continue;
+        }
+
+        if(!node) {
+            pthread_mutex_lock(&root->alloc_lock);
+            node = alloc_node(root);
+            pthread_mutex_unlock(&root->alloc_lock);
+            if(!node)
+                goto out;
+        }
+
+        node->byte = newbyte;
+        node->otherbits = newotherbits;
+        node->child[newdirection] = old;
+        node->child[1 - newdirection] = x;
+#ifdef CRITBIT_COUNTED
+        node->count = subtree_count(old) + 1;
+#endif
 
-    // swap two locks
-    if(!__sync_val_compare_and_swap(&root->cur_rwlock, lock, newlock)) {
-        printf("!!!\n");
+        if(__sync_bool_compare_and_swap(trail.entries[i].slot, old, FROM_NODE(node))) {
+#ifdef CRITBIT_COUNTED
+            int j;
+            for(j = 0; j < i; j++) {
+                ++((critbit_node *)TO_NODE(trail.entries[j].value))->count;
+            }
+#endif
+            count_key(root, i + 1, 1);
+            count_leaf(root, x, 1);
+            __sync_fetch_and_add(&root->node_count, 1);
+            used = 1;
+            published = 1;
+            ret = 0;
+            goto out;
+        }
     }
-    if(!__sync_val_compare_and_swap(&root->prev_rwlock, newlock, lock)) {
-        printf("!!!\n");
+
+out:
+    read_end(root);
+#ifdef CRITBIT_COUNTED
+    pthread_mutex_unlock(&root->wlock);
+#endif
+    trail_destroy(&trail);
+
+    if(published)
+        __sync_fetch_and_add(&root->version, 1);
+
+    // nothing we didn't publish has been seen by anyone, free it right away
+    pthread_mutex_lock(&root->alloc_lock);
+    if(node && !used)
+        free_node(root, node);
+    if(x && !published)
+        free_leaf(root, x);
+    pthread_mutex_unlock(&root->alloc_lock);
+
+    return ret;
+}
+
+int critbit_insert_len(critbit_root *root, const void *key, size_t len, const void* value) {
+    insert_op op = {value, NULL, NULL, 0, NULL};
+    return critbit_insert_cas(root, key, len, &op) ? 1 : 0;
+}
+
+int critbit_insert(critbit_root *root, const char *key, const void* value) {
+    return critbit_insert_len(root, key, strlen(key), value);
+}
+
+int critbit_upsert_len(critbit_root *root, const void *key, size_t len,
+        const void *value, void **old) {
+    insert_op op = {value, NULL, NULL, 1, NULL};
+    int ret = critbit_insert_cas(root, key, len, &op);
+    if(old)
+        *old = op.old;
+    return ret;
+}
+
+int critbit_upsert(critbit_root *root, const char *key, const void *value, void **old) {
+    return critbit_upsert_len(root, key, strlen(key), value, old);
+}
+
+int critbit_get_or_insert_len(critbit_root *root, const void *key, size_t len,
+        critbit_make_value make, void *data, void **out) {
+    insert_op op = {NULL, make, data, 0, NULL};
+    int ret = critbit_insert_cas(root, key, len, &op);
+    if(ret >= 0)
+        *out = ret ? op.old : (void *)op.value;
+    return ret;
+}
+
+int critbit_get_or_insert(critbit_root *root, const char *key,
+        critbit_make_value make, void *data, void **out) {
+    return critbit_get_or_insert_len(root, key, strlen(key), make, data, out);
+}
+
+// Atomic updates of an existing key's value, under reader protection only.
+// An allocated leaf's value is updated in place. An inline value lives in
+// the child word, which is swapped by a CAS instead, for an allocated leaf
+// once the value doesn't fit any more. Either way every update of a key
+// goes through the same word, so they're atomic with respect to each other.
+// returns 0 on success, 1 if the key is missing or, for UPDATE_CAS, holds
+// another value. the value before the update is stored in old
+static int critbit_update(critbit_root *root, const uint8_t *bytes, size_t keylen,
+        int kind, void *expected, void *arg, void **old) {
+    int ret = 1;
+
+    read_begin(root);
+    if(root->nsnapshots) {
+        read_end(root);
+        return snapshot_update(root, bytes, keylen, kind, expected, arg, old);
     }
+    for(;;) {
+        void **slot = &root->head;
+        void *p = *slot;
+        if(!p)
+            break;
+        while(IS_INTERNAL(p)) {
+            critbit_node *q = TO_NODE(p);
+            slot = q->child + get_direction(q, bytes, keylen);
+            p = *slot;
+        }
+        if(!leaf_matches(UNMARK(p), bytes, keylen))
+            break;
 
-    // wait until all readers are out
-    pthread_rwlock_wrlock(lock);
-    pthread_rwlock_unlock(lock);
+        if(!IS_INLINE(p)) {
+            critbit_leaf *leaf = UNMARK(p);
+            if(kind == UPDATE_CAS) {
+                *old = __sync_val_compare_and_swap(&leaf->value, expected, arg);
+                ret = *old != expected;
+            } else if(kind == UPDATE_ADD) {
+                *old = (void *)__sync_fetch_and_add((size_t *)&leaf->value, (size_t)arg);
+                ret = 0;
+            } else {
+                *old = __atomic_exchange_n(&leaf->value, arg, __ATOMIC_SEQ_CST);
+                ret = 0;
+            }
+            break;
+        }
 
-    // end critical section
-    pthread_mutex_unlock(&root->wlock);
+        // a marked leaf is being deleted, once it's unlinked the key is gone
+        if(IS_MARKED(p)) {
+            sched_yield();
+            continue;
+        }
 
-    if(!p)
-        return 1;
+        void *cur = leaf_value(p), *value = arg;
+        *old = cur;
+        if(kind == UPDATE_CAS && cur != expected)
+            break;
+        if(kind == UPDATE_ADD)
+            value = (void *)((size_t)cur + (size_t)arg);
 
-    if(!IS_INTERNAL(p)) {
-        free_string(p);
-    } else {
-        critbit_node *node = TO_NODE(p);
-        if(!IS_INTERNAL(node->child[0]) && strcmp(key, (const char *)node->child[0]) == 0) {
-            free_string(node->child[0]);
-            free_node(root, node);
+        void *x;
+        if(inline_fits(keylen, value)) {
+            x = inline_leaf(bytes, keylen, value);
         } else {
-            free_string(node->child[1]);
-            free_node(root, node);
+            pthread_mutex_lock(&root->alloc_lock);
+            x = alloc_leaf(root, bytes, keylen, value);
+            pthread_mutex_unlock(&root->alloc_lock);
+            if(!x)
+                break;
         }
+
+        if(__sync_bool_compare_and_swap(slot, p, x)) {
+            count_leaf(root, x, 1);
+            ret = 0;
+            break;
+        }
+
+        pthread_mutex_lock(&root->alloc_lock);
+        free_leaf(root, x);
+        pthread_mutex_unlock(&root->alloc_lock);
     }
+    read_end(root);
 
-    return 0;
+    return ret;
 }
 
-int critbit_get(critbit_root *root, const char *key, void **out) {
-    const int len = strlen(key);
-    const uint8_t *bytes = (void *)key;
+int critbit_cas_value_len(critbit_root *root, const void *key, size_t len,
+        void *expected, void *desired) {
+    void *old;
+    return critbit_update(root, key, len, UPDATE_CAS, expected, desired, &old);
+}
 
-    pthread_rwlock_t *lock = root->cur_rwlock;
-    pthread_rwlock_rdlock(lock);
-    char *nearest = find_nearest(root->head, bytes, len);
+int critbit_cas_value(critbit_root *root, const char *key, void *expected, void *desired) {
+    return critbit_cas_value_len(root, key, strlen(key), expected, desired);
+}
 
-    int ret = 1;
-    if(strcmp(nearest, key) == 0) {
-        nearest -= sizeof(void *);
-        *out = *((void **)nearest);
-        ret = 0;
-    }
-    pthread_rwlock_unlock(lock);
+int critbit_fetch_add_len(critbit_root *root, const void *key, size_t len,
+        intptr_t delta, void **old) {
+    void *prev;
+    int ret = critbit_update(root, key, len, UPDATE_ADD, NULL, (void *)delta, &prev);
+    if(!ret && old)
+        *old = prev;
+    return ret;
+}
+
+int critbit_fetch_add(critbit_root *root, const char *key, intptr_t delta, void **old) {
+    return critbit_fetch_add_len(root, key, strlen(key), delta, old);
+}
 
+int critbit_exchange_value_len(critbit_root *root, const void *key, size_t len,
+        void *value, void **old) {
+    void *prev;
+    int ret = critbit_update(root, key, len, UPDATE_EXCHANGE, NULL, value, &prev);
+    if(!ret && old)
+        *old = prev;
     return ret;
 }
 
-static void clear_node(void *p) {
-    if(IS_INTERNAL(p)) {
-        // Internal node
-        critbit_node *node = TO_NODE(p);
-        clear_node(node->child[0]);
-        clear_node(node->child[1]);
-        free(node);
-    } else {
-        free_string(p);
+int critbit_exchange_value(critbit_root *root, const char *key, void *value, void **old) {
+    return critbit_exchange_value_len(root, key, strlen(key), value, old);
+}
+
+// finds the slot pointing at node, which must still be linked
+static void **find_slot(critbit_root *root, critbit_node *node,
+        const uint8_t *bytes, size_t keylen) {
+    void **slot = &root->head;
+    for(;;) {
+        void *p = *slot;
+        critbit_node *q = TO_NODE(p);
+        if(q == node)
+            return slot;
+        slot = q->child + get_direction(q, bytes, keylen);
     }
 }
 
-void critbit_clear(critbit_root *root) {
-    if(!root->head)
-        return;
+// Unlinks the leaf for key, the parent node if any is returned in outnode.
+// Deletes are serialized by wlock, but run concurrently with inserts: both
+// child slots of the parent are marked first, so no insert can land below
+// it, then the grandparent slot is swung over to the sibling.
+static void *critbit_delete_inplace(critbit_root *root,
+        const uint8_t *bytes, size_t keylen, critbit_node **outnode) {
+    void *p;
+    int depth;
+    for(;;) {
+        p = root->head;
+        if(!p)
+            return NULL;
 
-    clear_node(root->head);
-    root->head = NULL;
-    free(root);
+        void **wherep = &root->head, **whereq = 0;
+        critbit_node *q = NULL;
+        int dir = 0;
+        depth = 0;
+
+        while(IS_INTERNAL(p)) {
+            ++depth;
+            whereq = wherep;
+            q = TO_NODE(p);
+            dir = get_direction(q, bytes, keylen);
+            wherep = q->child + dir;
+            p = UNMARK(*wherep);
+        }
+
+        if(!leaf_matches(p, bytes, keylen)) {
+            return NULL;
+        }
+
+        if(!whereq) {
+            if(!__sync_bool_compare_and_swap(&root->head, p, NULL))
+                continue;
+            *outnode = NULL;
+            break;
+        }
+
+        // an insert may have put a node above the leaf, look again
+        if(!__sync_bool_compare_and_swap(wherep, p, MARK(p)))
+            continue;
+
+        void **wheres = q->child + 1 - dir;
+        void *sibling;
+        do {
+            sibling = *wheres;
+        } while(!__sync_bool_compare_and_swap(wheres, sibling, MARK(sibling)));
+
+        // q is frozen now, only inserts above it can move its parent slot
+        while(!__sync_bool_compare_and_swap(whereq, FROM_NODE(q), sibling)) {
+            whereq = find_slot(root, q, bytes, keylen);
+        }
+
+#ifdef CRITBIT_COUNTED
+        // inserts hold wlock as well, nothing moved above q
+        void **slot = &root->head;
+        while(slot != whereq) {
+            critbit_node *a = TO_NODE(*slot);
+            --a->count;
+            slot = a->child + get_direction(a, bytes, keylen);
+        }
+#endif
+
+        *outnode = q;
+        __sync_fetch_and_sub(&root->node_count, 1);
+        break;
+    }
+    __sync_fetch_and_add(&root->version, 1);
+    count_key(root, depth, -1);
+    count_leaf(root, p, -1);
+
+    return p;
+}
+
+int critbit_delete_len(critbit_root *root, const void *key, size_t len) {
+    // begin critical section
+    pthread_mutex_lock(&root->wlock);
+
+    if(root->nsnapshots) {
+        int ret = snapshot_delete(root, key, len);
+        pthread_mutex_unlock(&root->wlock);
+        return ret;
+    }
+
+    critbit_node *node = NULL;
+    void *leaf = critbit_delete_inplace(root, key, len, &node);
+
+    // readers may still be looking at them, free after a grace period
+    if(leaf) {
+        if(!IS_INLINE(leaf))
+            retire(root, leaf);
+        if(node)
+            retire(root, FROM_NODE(node));
+    }
+
+    // end critical section, the retire list is only touched under wlock
+    pthread_mutex_unlock(&root->wlock);
+
+    return leaf ? 0 : 1;
+}
+
+int critbit_delete(critbit_root *root, const char *key) {
+    return critbit_delete_len(root, key, strlen(key));
+}
+
+int critbit_get_len(critbit_root *root, const void *key, size_t len, void **out) {
+    read_begin(root);
+
+    int ret = 1;
+    void *nearest = root->head;
+    if(nearest) {
+        nearest = find_nearest(nearest, key, len);
+        if(leaf_matches(nearest, key, len)) {
+            *out = leaf_value(nearest);
+            ret = 0;
+        }
+    }
+    read_end(root);
+
+    return ret;
+}
+
+// Lookups in a batch go down the tree in lockstep, a window at a time. Each
+// round moves every lookup in the window one level down and prefetches the
+// child it lands on, so the misses of different keys overlap instead of
+// being waited out one after the other.
+#define GET_BATCH_WINDOW 16
+
+int critbit_get_batch(critbit_root *root, const void *const *keys, const size_t *lens,
+        void **out, size_t n) {
+    void *p[GET_BATCH_WINDOW];
+    int found = 0;
+
+    read_begin(root);
+
+    void *head = root->head;
+    size_t base;
+    for(base = 0; base < n; base += GET_BATCH_WINDOW) {
+        int i, w = n - base < GET_BATCH_WINDOW ? n - base : GET_BATCH_WINDOW;
+        for(i = 0; i < w; i++) {
+            p[i] = head;
+        }
+
+        int active = head && IS_INTERNAL(head) ? w : 0;
+        while(active) {
+            active = 0;
+            for(i = 0; i < w; i++) {
+                if(!IS_INTERNAL(p[i]))
+                    continue;
+
+                critbit_node *node = TO_NODE(p[i]);
+                void *next = CHILD(node, get_direction(node, keys[base + i], lens[base + i]));
+                __builtin_prefetch(TO_NODE(next));
+                p[i] = next;
+                active += IS_INTERNAL(next);
+            }
+        }
+
+        for(i = 0; i < w; i++) {
+            void *leaf = p[i];
+            out[base + i] = NULL;
+            if(leaf && leaf_matches(leaf, keys[base + i], lens[base + i])) {
+                out[base + i] = leaf_value(leaf);
+                ++found;
+            }
+        }
+    }
+
+    read_end(root);
+
+    return found;
+}
+
+int critbit_get(critbit_root *root, const char *key, void **out) {
+    return critbit_get_len(root, key, strlen(key), out);
+}
+
+// A key ending where the query goes on hangs off a node testing the
+// presence bit of the byte past its end, alone on the 0 side. It agrees
+// with every key on the 1 side up to there, so once the leaf the query
+// leads to shows how far it matches the query, the answer is the deepest
+// of those keys within that. None of them has to be looked at.
+#define PREFIX_CANDIDATES 32
+
+typedef struct prefix_candidate {
+    void *leaf;
+    size_t len;
+} prefix_candidate;
+
+int critbit_longest_prefix(critbit_root *root, const void *key, size_t len,
+        size_t *matched_len, void **value) {
+    const uint8_t *bytes = key;
+    prefix_candidate inline_cand[PREFIX_CANDIDATES], *cand = inline_cand;
+    int ncand = 0, cap = PREFIX_CANDIDATES, ret = 1;
+
+    read_begin(root);
+
+    void *p = root->head;
+    while(p && IS_INTERNAL(p)) {
+        critbit_node *node = TO_NODE(p);
+        int dir = get_direction(node, bytes, len);
+        void *shorter = CHILD(node, 0);
+        if(dir && node->otherbits == 0xFF && !IS_INTERNAL(shorter)) {
+            if(ncand == cap) {
+                prefix_candidate *more = cand == inline_cand ?
+                    malloc(cap * 2 * sizeof(prefix_candidate)) :
+                    realloc(cand, cap * 2 * sizeof(prefix_candidate));
+                if(!more) {
+                    ret = -1;
+                    goto out;
+                }
+                if(cand == inline_cand)
+                    memcpy(more, inline_cand, sizeof(inline_cand));
+                cand = more;
+                cap *= 2;
+            }
+            cand[ncand].leaf = shorter;
+            cand[ncand].len = node->byte;
+            ++ncand;
+        }
+        p = CHILD(node, dir);
+    }
+
+    if(p) {
+        leaf_view leaf;
+        leaf_load(&leaf, p);
+        size_t matched = 0, n = leaf.len < len ? leaf.len : len;
+        while(matched < n && leaf.key[matched] == bytes[matched]) {
+            ++matched;
+        }
+
+        if(matched == leaf.len) {
+            *matched_len = leaf.len;
+            *value = leaf.value;
+            ret = 0;
+        } else {
+            while(ncand && cand[ncand - 1].len > matched) {
+                --ncand;
+            }
+            if(ncand) {
+                *matched_len = cand[ncand - 1].len;
+                *value = leaf_value(cand[ncand - 1].leaf);
+                ret = 0;
+            }
+        }
+    }
+
+out:
+    read_end(root);
+    if(cand != inline_cand)
+        free(cand);
+    return ret;
+}
+
+enum {
+    CURSOR_AT,      // on a key
+    CURSOR_BEGIN,   // before the first key
+    CURSOR_END,     // past the last key
+};
+
+static int cursor_push(critbit_cursor *cur, critbit_node *node, int dir) {
+    if(cur->depth == cur->cap) {
+        int cap = cur->cap ? cur->cap * 2 : 32;
+        critbit_step *path = realloc(cur->path, cap * sizeof(critbit_step));
+        if(!path)
+            return 1;
+        cur->path = path;
+        cur->cap = cap;
+    }
+    cur->path[cur->depth].node = node;
+    cur->path[cur->depth].dir = dir;
+    ++cur->depth;
+    return 0;
+}
+
+static int cursor_set(critbit_cursor *cur, void *leaf) {
+    cur->leaf = leaf;
+    cur->state = CURSOR_AT;
+    return 0;
+}
+
+// copies the current key out of the leaf before reader protection is dropped
+static int cursor_save(critbit_cursor *cur) {
+    if(cur->state != CURSOR_AT)
+        return 0;
+
+    leaf_view leaf;
+    leaf_load(&leaf, cur->leaf);
+    if(leaf.len + 1 > cur->keycap) {
+        size_t cap = leaf.len + 1 > 32 ? leaf.len + 1 : 32;
+        uint8_t *key = realloc(cur->key, cap);
+        if(!key) {
+            cur->state = CURSOR_END;
+            return 1;
+        }
+        cur->key = key;
+        cur->keycap = cap;
+    }
+    memcpy(cur->key, leaf.key, leaf.len + 1);
+    cur->len = leaf.len;
+    cur->value = leaf.value;
+    return 0;
+}
+
+// follows child[dir] down to a leaf: dir 0 gives the smallest key of the
+// subtree, dir 1 the largest
+static int cursor_descend(critbit_cursor *cur, void *p, int dir) {
+    while(IS_INTERNAL(p)) {
+        critbit_node *node = TO_NODE(p);
+        if(cursor_push(cur, node, dir)) {
+            cur->state = CURSOR_END;
+            return 1;
+        }
+        p = CHILD(node, dir);
+    }
+    return cursor_set(cur, p);
+}
+
+// moves to the neighbouring leaf, dir 1 for next and 0 for previous
+static int cursor_step(critbit_cursor *cur, int dir) {
+    if(cur->state != CURSOR_AT) {
+        if(cur->state == (dir ? CURSOR_END : CURSOR_BEGIN))
+            return 1;
+
+        cur->depth = 0;
+        void *head = *cur->head;
+        if(!head) {
+            cur->state = dir ? CURSOR_END : CURSOR_BEGIN;
+            return 1;
+        }
+        return cursor_descend(cur, head, 1 - dir);
+    }
+
+    while(cur->depth > 0 && cur->path[cur->depth - 1].dir == dir) {
+        --cur->depth;
+    }
+    if(!cur->depth) {
+        cur->state = dir ? CURSOR_END : CURSOR_BEGIN;
+        return 1;
+    }
+
+    critbit_step *step = &cur->path[cur->depth - 1];
+    step->dir = dir;
+    return cursor_descend(cur, CHILD(step->node, dir), 1 - dir);
+}
+
+// positions the cursor at the first key >= key
+static int cursor_locate(critbit_cursor *cur, const uint8_t *bytes, size_t len) {
+    critbit_root *root = cur->root;
+    cur->depth = 0;
+    cur->version = root->version;
+
+    void *p = *cur->head;
+    if(!p) {
+        cur->state = CURSOR_END;
+        return 1;
+    }
+
+    void *nearest = find_nearest(p, bytes, len);
+    uint32_t newbyte, newotherbits;
+    int exact = find_critbit(nearest, bytes, len, &newbyte, &newotherbits);
+    if(exact) {
+        // walk the same path again, all the way down to the leaf
+        newbyte = UINT32_MAX;
+        newotherbits = 0;
+    }
+
+    // walk down to the subtree the key would be inserted above
+    while(IS_INTERNAL(p)) {
+        critbit_node *q = TO_NODE(p);
+        if(q->byte > newbyte)
+            break;
+        if(q->byte == newbyte && q->otherbits > newotherbits)
+            break;
+
+        int dir = get_direction(q, bytes, len);
+        if(cursor_push(cur, q, dir)) {
+            cur->state = CURSOR_END;
+            return 1;
+        }
+        p = CHILD(q, dir);
+    }
+
+    if(exact || !key_direction(newbyte, newotherbits, bytes, len)) {
+        // the key is <= everything below p
+        return cursor_descend(cur, p, 0);
+    }
+
+    // the key is greater than everything below p, take the next subtree
+    while(cur->depth > 0 && cur->path[cur->depth - 1].dir == 1) {
+        --cur->depth;
+    }
+    if(!cur->depth) {
+        cur->state = CURSOR_END;
+        return 1;
+    }
+
+    critbit_step *step = &cur->path[cur->depth - 1];
+    step->dir = 1;
+    return cursor_descend(cur, CHILD(step->node, 1), 0);
+}
+
+static void cursor_init(critbit_cursor *cur, critbit_root *root, void **head) {
+    memset(cur, 0, sizeof(*cur));
+    cur->root = root;
+    cur->head = head;
+    cur->state = CURSOR_END;
+}
+
+static void cursor_destroy(critbit_cursor *cur) {
+    free(cur->path);
+    free(cur->key);
+}
+
+critbit_cursor *critbit_seek_len(critbit_root *root, const void *key, size_t len) {
+    critbit_cursor *cur = malloc(sizeof(critbit_cursor));
+    if(!cur)
+        return NULL;
+    cursor_init(cur, root, &root->head);
+
+    read_begin(root);
+    cursor_locate(cur, key, len);
+    cursor_save(cur);
+    read_end(root);
+
+    return cur;
+}
+
+critbit_cursor *critbit_seek(critbit_root *root, const char *key) {
+    return critbit_seek_len(root, key, strlen(key));
+}
+
+// moves the cursor, re-seeking from the saved key if the tree has changed
+static int cursor_move(critbit_cursor *cur, int dir) {
+    critbit_root *root = cur->root;
+    read_begin(root);
+
+    int ret;
+    if(cur->state == CURSOR_AT && cur->version != root->version) {
+        // the path may be stale, find our place again from the saved key
+        cursor_locate(cur, cur->key, cur->len);
+        leaf_view leaf;
+        if(cur->state == CURSOR_AT)
+            leaf_load(&leaf, cur->leaf);
+        if(dir && cur->state == CURSOR_AT &&
+                key_compare(leaf.key, leaf.len, cur->key, cur->len) > 0) {
+            // the saved key is gone, we're already past it
+            ret = 0;
+        } else {
+            ret = cursor_step(cur, dir);
+        }
+    } else {
+        cur->version = root->version;
+        ret = cursor_step(cur, dir);
+    }
+    if(cursor_save(cur))
+        ret = 1;
+
+    read_end(root);
+    return ret;
+}
+
+int critbit_next(critbit_cursor *cur) {
+    return cursor_move(cur, 1);
+}
+
+int critbit_prev(critbit_cursor *cur) {
+    return cursor_move(cur, 0);
+}
+
+const char *critbit_cursor_key(critbit_cursor *cur, size_t *len) {
+    if(cur->state != CURSOR_AT)
+        return NULL;
+    if(len)
+        *len = cur->len;
+    return (const char *)cur->key;
+}
+
+void *critbit_cursor_value(critbit_cursor *cur) {
+    if(cur->state != CURSOR_AT)
+        return NULL;
+    return cur->value;
+}
+
+void critbit_cursor_free(critbit_cursor *cur) {
+    if(!cur)
+        return;
+    cursor_destroy(cur);
+    free(cur);
+}
+
+// walks [lo, hi) with reader protection, if any, already taken
+static int range_walk(critbit_cursor *cur,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data) {
+    if(lo) {
+        cursor_locate(cur, lo, lolen);
+    } else {
+        cur->state = CURSOR_BEGIN;
+        cursor_step(cur, 1);
+    }
+
+    int ret = 0;
+    while(cur->state == CURSOR_AT) {
+        leaf_view leaf;
+        leaf_load(&leaf, cur->leaf);
+        if(hi && key_compare(leaf.key, leaf.len, hi, hilen) >= 0)
+            break;
+
+        ret = cb(data, (const char *)leaf.key, leaf.len, leaf.value);
+        if(ret)
+            break;
+
+        cursor_step(cur, 1);
+    }
+    return ret;
+}
+
+int critbit_range_len(critbit_root *root,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data) {
+    critbit_cursor cur;
+    cursor_init(&cur, root, &root->head);
+
+    read_begin(root);
+    int ret = range_walk(&cur, lo, lolen, hi, hilen, cb, data);
+    read_end(root);
+    cursor_destroy(&cur);
+
+    return ret;
+}
+
+int critbit_range(critbit_root *root, const char *lo, const char *hi,
+        critbit_callback cb, void *data) {
+    return critbit_range_len(root, lo, lo ? strlen(lo) : 0,
+            hi, hi ? strlen(hi) : 0, cb, data);
+}
+
+// calls cb for the keys with the prefix in the tree at head, with reader
+// protection, if any, already taken
+static int prefix_walk(critbit_root *root, void **head,
+        const char *prefix, int prefix_len, critbit_callback cb, void *data) {
+    const uint8_t *bytes = (const uint8_t *)prefix;
+
+    // descend while the prefix decides the direction, every key below top
+    // shares the bits of the prefix that were tested on the way
+    void *top = *head;
+    while(IS_INTERNAL(top)) {
+        critbit_node *q = TO_NODE(top);
+        if(q->byte >= prefix_len)
+            break;
+        top = CHILD(q, get_direction(q, bytes, prefix_len));
+    }
+
+    int ret = 0;
+    void *nearest = top ? find_nearest(top, bytes, prefix_len) : NULL;
+    leaf_view leaf;
+    if(nearest)
+        leaf_load(&leaf, nearest);
+    if(!nearest || leaf.len < prefix_len || memcmp(leaf.key, bytes, prefix_len) != 0)
+        return 0;
+
+    // the cursor path starts at top, so stepping stops at its last leaf
+    critbit_cursor cur;
+    cursor_init(&cur, root, head);
+    cursor_descend(&cur, top, 0);
+    while(cur.state == CURSOR_AT) {
+        leaf_load(&leaf, cur.leaf);
+        ret = cb(data, (const char *)leaf.key, leaf.len, leaf.value);
+        if(ret)
+            break;
+        cursor_step(&cur, 1);
+    }
+    cursor_destroy(&cur);
+
+    return ret;
+}
+
+int critbit_iter_prefix(critbit_root *root, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data) {
+    read_begin(root);
+    int ret = prefix_walk(root, &root->head, prefix, prefix_len, cb, data);
+    read_end(root);
+
+    return ret;
+}
+
+// Neighbour queries. A lookup that misses still ends at the leaf sharing
+// the most bits with the key, and the bit where they differ tells on
+// which side of the key the subtree hanging there lies. Otherwise the
+// closest key on the wanted side is the extreme leaf of the last subtree
+// the descent passed by on that side. The second descent runs over
+// nodes the first one just brought into the cache.
+static void *extreme_leaf(void *p, int dir) {
+    while(IS_INTERNAL(p)) {
+        p = CHILD((critbit_node *)TO_NODE(p), dir);
+    }
+    return p;
+}
+
+// the leaf of the closest key after key if dir is 0, before it if dir is
+// 1, or of key itself if it's there and inclusive is set
+static void *neighbour_leaf(void *head, const uint8_t *bytes, size_t len,
+        int dir, int inclusive) {
+    if(!head)
+        return NULL;
+
+    void *nearest = find_nearest(head, bytes, len);
+    uint32_t critbyte, critother;
+    int exact = find_critbit(nearest, bytes, len, &critbyte, &critother);
+    if(exact && inclusive)
+        return nearest;
+
+    void *p = head, *passed = NULL;
+    while(IS_INTERNAL(p)) {
+        critbit_node *node = TO_NODE(p);
+        if(!exact && !crit_before(node->byte, node->otherbits, critbyte, critother))
+            break;
+        int d = get_direction(node, bytes, len);
+        if(d == dir)
+            passed = CHILD(node, !dir);
+        p = CHILD(node, d);
+    }
+
+    if(!exact && key_direction(critbyte, critother, bytes, len) == dir)
+        return extreme_leaf(p, dir);
+    return passed ? extreme_leaf(passed, dir) : NULL;
+}
+
+static int neighbour_report(void *leaf, critbit_callback cb, void *data) {
+    if(!leaf)
+        return 1;
+    leaf_view view;
+    leaf_load(&view, leaf);
+    cb(data, (const char *)view.key, view.len, view.value);
+    return 0;
+}
+
+static int neighbour(critbit_root *root, const void *key, size_t len,
+        int dir, int inclusive, critbit_callback cb, void *data) {
+    read_begin(root);
+    int ret = neighbour_report(neighbour_leaf(root->head, key, len, dir, inclusive), cb, data);
+    read_end(root);
+    return ret;
+}
+
+int critbit_first(critbit_root *root, critbit_callback cb, void *data) {
+    read_begin(root);
+    void *head = root->head;
+    int ret = neighbour_report(head ? extreme_leaf(head, 0) : NULL, cb, data);
+    read_end(root);
+    return ret;
+}
+
+int critbit_last(critbit_root *root, critbit_callback cb, void *data) {
+    read_begin(root);
+    void *head = root->head;
+    int ret = neighbour_report(head ? extreme_leaf(head, 1) : NULL, cb, data);
+    read_end(root);
+    return ret;
+}
+
+int critbit_lower_bound_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data) {
+    return neighbour(root, key, len, 0, 1, cb, data);
+}
+
+int critbit_lower_bound(critbit_root *root, const char *key,
+        critbit_callback cb, void *data) {
+    return critbit_lower_bound_len(root, key, strlen(key), cb, data);
+}
+
+int critbit_upper_bound_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data) {
+    return neighbour(root, key, len, 0, 0, cb, data);
+}
+
+int critbit_upper_bound(critbit_root *root, const char *key,
+        critbit_callback cb, void *data) {
+    return critbit_upper_bound_len(root, key, strlen(key), cb, data);
+}
+
+int critbit_floor_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data) {
+    return neighbour(root, key, len, 1, 1, cb, data);
+}
+
+int critbit_floor(critbit_root *root, const char *key,
+        critbit_callback cb, void *data) {
+    return critbit_floor_len(root, key, strlen(key), cb, data);
+}
+
+int critbit_ceiling_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data) {
+    return neighbour(root, key, len, 0, 1, cb, data);
+}
+
+int critbit_ceiling(critbit_root *root, const char *key,
+        critbit_callback cb, void *data) {
+    return critbit_ceiling_len(root, key, strlen(key), cb, data);
+}
+
+int critbit_predecessor_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data) {
+    return neighbour(root, key, len, 1, 0, cb, data);
+}
+
+int critbit_predecessor(critbit_root *root, const char *key,
+        critbit_callback cb, void *data) {
+    return critbit_predecessor_len(root, key, strlen(key), cb, data);
+}
+
+#ifdef CRITBIT_COUNTED
+// The same descent as neighbour_leaf, adding up the subtrees passed on the
+// left. Where it stops, the subtree is all before key or all after it.
+static size_t rank_of(void *head, const uint8_t *bytes, size_t len) {
+    if(!head)
+        return 0;
+
+    void *nearest = find_nearest(head, bytes, len);
+    uint32_t critbyte, critother;
+    int exact = find_critbit(nearest, bytes, len, &critbyte, &critother);
+
+    size_t rank = 0;
+    void *p = head;
+    while(IS_INTERNAL(p)) {
+        critbit_node *node = TO_NODE(p);
+        if(!exact && !crit_before(node->byte, node->otherbits, critbyte, critother))
+            break;
+        int d = get_direction(node, bytes, len);
+        if(d)
+            rank += subtree_count(CHILD(node, 0));
+        p = CHILD(node, d);
+    }
+
+    if(!exact && key_direction(critbyte, critother, bytes, len))
+        rank += subtree_count(p);
+    return rank;
+}
+
+// the leaf of the key with rank k, NULL if there are no more keys
+static void *select_leaf(void *head, size_t k) {
+    if(k >= subtree_count(head))
+        return NULL;
+
+    void *p = head;
+    while(IS_INTERNAL(p)) {
+        critbit_node *node = TO_NODE(p);
+        size_t left = subtree_count(CHILD(node, 0));
+        if(k < left) {
+            p = CHILD(node, 0);
+        } else {
+            k -= left;
+            p = CHILD(node, 1);
+        }
+    }
+    return p;
+}
+
+size_t critbit_rank_len(critbit_root *root, const void *key, size_t len) {
+    read_begin(root);
+    size_t rank = rank_of(root->head, key, len);
+    read_end(root);
+    return rank;
+}
+
+size_t critbit_rank(critbit_root *root, const char *key) {
+    return critbit_rank_len(root, key, strlen(key));
+}
+
+int critbit_select(critbit_root *root, size_t k, critbit_callback cb, void *data) {
+    read_begin(root);
+    int ret = neighbour_report(select_leaf(root->head, k), cb, data);
+    read_end(root);
+    return ret;
+}
+
+size_t critbit_count_range_len(critbit_root *root,
+        const void *lo, size_t lolen, const void *hi, size_t hilen) {
+    if(key_compare(lo, lolen, hi, hilen) >= 0)
+        return 0;
+
+    read_begin(root);
+    size_t below_lo = rank_of(root->head, lo, lolen);
+    size_t below_hi = rank_of(root->head, hi, hilen);
+    read_end(root);
+
+    // a writer may have run in between
+    return below_hi > below_lo ? below_hi - below_lo : 0;
+}
+
+size_t critbit_count_range(critbit_root *root, const char *lo, const char *hi) {
+    return critbit_count_range_len(root, lo, strlen(lo), hi, strlen(hi));
+}
+
+// xorshift64*, seeded on first use from where each thread keeps its state
+static __thread uint64_t random_state;
+
+static uint64_t random_next(void) {
+    if(!random_state)
+        random_state = (uint64_t)(size_t)&random_state * 0x9E3779B97F4A7C15ULL | 1;
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+int critbit_random_key(critbit_root *root, critbit_callback cb, void *data) {
+    read_begin(root);
+    void *head = root->head;
+    size_t n = subtree_count(head);
+    int ret = neighbour_report(n ? select_leaf(head, random_next() % n) : NULL, cb, data);
+    read_end(root);
+    return ret;
+}
+#endif
+
+// A snapshot is the head of the tree when it was taken. As writers never
+// change what a snapshot can see, reading it needs no protection at all.
+struct critbit_view {
+    critbit_root *root;
+    void *head;
+    unsigned long generation;
+    struct critbit_view *prev, *next;
+};
+
+critbit_view *critbit_snapshot(critbit_root *root) {
+    critbit_view *view = malloc(sizeof(critbit_view));
+    if(!view)
+        return NULL;
+
+    pthread_mutex_lock(&root->wlock);
+    if(!root->nsnapshots++) {
+        // lock-free writers that haven't seen the snapshot yet may still
+        // change the tree in place, wait for them
+        ebr_synchronize();
+    }
+
+    view->root = root;
+    view->head = root->head;
+    view->generation = ++root->generation;
+
+    // generations only grow, so the list stays oldest first
+    view->next = NULL;
+    view->prev = root->snapshots;
+    while(view->prev && view->prev->next)
+        view->prev = view->prev->next;
+    if(view->prev)
+        view->prev->next = view;
+    else
+        root->snapshots = view;
+    pthread_mutex_unlock(&root->wlock);
+
+    return view;
+}
+
+void critbit_snapshot_release(critbit_view *view) {
+    if(!view)
+        return;
+
+    critbit_root *root = view->root;
+    pthread_mutex_lock(&root->wlock);
+    if(view->prev)
+        view->prev->next = view->next;
+    else
+        root->snapshots = view->next;
+    if(view->next)
+        view->next->prev = view->prev;
+    --root->nsnapshots;
+
+    // whatever was superseded before the oldest open snapshot was taken is
+    // out of reach of every snapshot, readers of the tree may still see it
+    unsigned long oldest = root->snapshots ? root->snapshots->generation : ULONG_MAX;
+    while(root->superseded_first < root->nsuperseded &&
+            root->superseded[root->superseded_first].generation < oldest) {
+        retire(root, root->superseded[root->superseded_first++].p);
+    }
+    if(root->superseded_first == root->nsuperseded) {
+        root->nsuperseded = 0;
+        root->superseded_first = 0;
+    }
+    pthread_mutex_unlock(&root->wlock);
+
+    free(view);
+}
+
+int critbit_snapshot_get_len(critbit_view *view, const void *key, size_t len, void **out) {
+    void *nearest = view->head;
+    if(!nearest)
+        return 1;
+
+    nearest = find_nearest(nearest, key, len);
+    if(!leaf_matches(nearest, key, len))
+        return 1;
+    *out = leaf_value(nearest);
+    return 0;
+}
+
+int critbit_snapshot_get(critbit_view *view, const char *key, void **out) {
+    return critbit_snapshot_get_len(view, key, strlen(key), out);
+}
+
+int critbit_snapshot_range_len(critbit_view *view,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data) {
+    critbit_cursor cur;
+    cursor_init(&cur, view->root, &view->head);
+    int ret = range_walk(&cur, lo, lolen, hi, hilen, cb, data);
+    cursor_destroy(&cur);
+
+    return ret;
+}
+
+int critbit_snapshot_range(critbit_view *view, const char *lo, const char *hi,
+        critbit_callback cb, void *data) {
+    return critbit_snapshot_range_len(view, lo, lo ? strlen(lo) : 0,
+            hi, hi ? strlen(hi) : 0, cb, data);
+}
+
+int critbit_snapshot_iter_prefix(critbit_view *view, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data) {
+    return prefix_walk(view->root, &view->head, prefix, prefix_len, cb, data);
+}
+
+void critbit_stats(critbit_root *root, critbit_statistics *out) {
+    out->keys = root->key_count;
+    out->nodes = root->node_count;
+    out->leaf_bytes = root->leaf_bytes;
+    out->bytes = out->nodes * sizeof(critbit_node) + out->leaf_bytes;
+#ifdef CRITBIT_MALLOC
+    out->reserved_bytes = out->bytes;
+#else
+    pthread_mutex_lock(&root->alloc_lock);
+    out->reserved_bytes = slab_bytes(&root->nodes) + slab_arena_bytes(&root->leaves);
+    pthread_mutex_unlock(&root->alloc_lock);
+#endif
+
+    // a bucket can dip below zero as the counts are only approximate
+    int i;
+    for(i = 0; i < CRITBIT_STATS_DEPTHS; i++) {
+        long n = root->depths[i];
+        out->depths[i] = n > 0 ? n : 0;
+    }
+}
+
+#ifdef CRITBIT_MALLOC
+// Frees a subtree without recursion. A node whose left child is a node is
+// rotated right, which moves one node off the left spine each time.
+// Otherwise its left child is a leaf, and the node goes with it.
+static void clear_tree(critbit_root *root, void *p) {
+    while(IS_INTERNAL(p)) {
+        critbit_node *node = TO_NODE(p);
+        void *left = CHILD(node, 0);
+        if(IS_INTERNAL(left)) {
+            critbit_node *q = TO_NODE(left);
+            node->child[0] = CHILD(q, 1);
+            q->child[1] = p;
+            p = left;
+            continue;
+        }
+
+        free_leaf(root, left);
+        p = CHILD(node, 1);
+        free_node(root, node);
+    }
+    if(p)
+        free_leaf(root, p);
+}
+
+#define CLEAR_MAX_THREADS 64
+// subtrees per thread, so that threads which finish early can help out
+#define CLEAR_SPLIT 8
+
+typedef struct clear_job {
+    critbit_root *root;
+    void **trees;
+    size_t n, next;
+} clear_job;
+
+static void *clear_thread(void *arg) {
+    clear_job *job = arg;
+    size_t i;
+    while((i = __sync_fetch_and_add(&job->next, 1)) < job->n) {
+        clear_tree(job->root, job->trees[i]);
+    }
+    return NULL;
+}
+
+// splits the top levels into subtrees that are freed on nthreads threads
+static void clear_parallel(critbit_root *root, int nthreads) {
+    void *trees[CLEAR_MAX_THREADS * CLEAR_SPLIT];
+    size_t want = nthreads * CLEAR_SPLIT, n = 1, i = 0, leaves = 0;
+    trees[0] = root->head;
+
+    // round robin over the subtrees, so that they shrink evenly
+    while(n < want && leaves < n) {
+        if(IS_INTERNAL(trees[i])) {
+            critbit_node *node = TO_NODE(trees[i]);
+            trees[i] = CHILD(node, 0);
+            trees[n++] = CHILD(node, 1);
+            free_node(root, node);
+            leaves = 0;
+        } else {
+            ++leaves;
+        }
+        i = (i + 1) % n;
+    }
+
+    clear_job job = {root, trees, n, 0};
+    pthread_t threads[CLEAR_MAX_THREADS];
+    int started[CLEAR_MAX_THREADS];
+    int t;
+    for(t = 1; t < nthreads; t++) {
+        started[t] = pthread_create(threads + t, NULL, clear_thread, &job) == 0;
+    }
+    clear_thread(&job);
+    for(t = 1; t < nthreads; t++) {
+        if(started[t])
+            pthread_join(threads[t], NULL);
+    }
+}
+#endif
+
+void critbit_clear_parallel(critbit_root *root, int nthreads) {
+    int reclaimer = root->reclaimer_running;
+    stop_reclaimer(root);
+
+#ifdef CRITBIT_MALLOC
+    ebr_limbo_destroy(&root->limbo, reclaim_item, root);
+    if(nthreads > CLEAR_MAX_THREADS)
+        nthreads = CLEAR_MAX_THREADS;
+    if(nthreads > 1 && IS_INTERNAL(root->head))
+        clear_parallel(root, nthreads);
+    else
+        clear_tree(root, root->head);
+#else
+    // every node and leaf lives in the slabs, which are dropped chunk by
+    // chunk. that's quick enough not to need any threads
+    ebr_limbo_destroy(&root->limbo, NULL, NULL);
+    slab_release(&root->nodes);
+    slab_arena_release(&root->leaves);
+#endif
+    root->head = NULL;
+
+    root->key_count = 0;
+    root->node_count = 0;
+    root->leaf_bytes = 0;
+    memset(root->depths, 0, sizeof(root->depths));
+    // open cursors have to find their place again
+    ++root->version;
+
+    if(reclaimer)
+        critbit_start_reclaimer(root);
+}
+
+void critbit_clear(critbit_root *root) {
+    critbit_clear_parallel(root, 1);
+}
+
+void critbit_free(critbit_root *root) {
+    stop_reclaimer(root);
+    critbit_clear(root);
+    free(root->superseded);
+    free(root);
+}
+
+// Bulk build. In sorted order, the tree is the Cartesian tree of the
+// critical bits between neighbouring keys: the earliest one is the root and
+// the keys on either side of it form its subtrees. Keeping the right spine
+// on a stack builds it in a single pass.
+#define BUILD_MIN_KEYS (64 * 1024)
+#define BUILD_MAX_THREADS 64
+#define BUILD_INSERTION 16
+
+typedef struct build_input {
+    const uint8_t *const *keys;
+    const size_t *lens;
+    void *const *vals;
+    // sorted permutation of the input, NULL if it's sorted already
+    const size_t *order;
+} build_input;
+
+typedef struct build_job {
+    const build_input *in;
+    size_t *src, *dst;
+    size_t lo, mid, hi;
+    critbit_root *root;
+    void *tree;
+    int failed;
+} build_job;
+
+static inline size_t build_index(const build_input *in, size_t i) {
+    return in->order ? in->order[i] : i;
+}
+
+static inline int build_compare(const build_input *in, size_t a, size_t b) {
+    return key_compare(in->keys[a], in->lens[a], in->keys[b], in->lens[b]);
+}
+
+// stable, so the first of equal keys stays first
+static void build_merge(const build_input *in, const size_t *src, size_t *dst,
+        size_t lo, size_t mid, size_t hi) {
+    size_t i = lo, j = mid, k = lo;
+    while(i < mid && j < hi) {
+        if(build_compare(in, src[j], src[i]) < 0)
+            dst[k++] = src[j++];
+        else
+            dst[k++] = src[i++];
+    }
+    while(i < mid)
+        dst[k++] = src[i++];
+    while(j < hi)
+        dst[k++] = src[j++];
+}
+
+static void build_sort(const build_input *in, size_t *order, size_t *tmp,
+        size_t lo, size_t hi) {
+    if(hi - lo <= BUILD_INSERTION) {
+        size_t i, j;
+        for(i = lo + 1; i < hi; i++) {
+            size_t x = order[i];
+            for(j = i; j > lo && build_compare(in, x, order[j - 1]) < 0; j--) {
+                order[j] = order[j - 1];
+            }
+            order[j] = x;
+        }
+        return;
+    }
+
+    size_t mid = lo + (hi - lo) / 2;
+    build_sort(in, order, tmp, lo, mid);
+    build_sort(in, order, tmp, mid, hi);
+    build_merge(in, order, tmp, lo, mid, hi);
+    memcpy(order + lo, tmp + lo, (hi - lo) * sizeof(size_t));
+}
+
+static void *build_sort_job(void *arg) {
+    build_job *job = arg;
+    build_sort(job->in, job->src, job->dst, job->lo, job->hi);
+    return NULL;
+}
+
+static void *build_merge_job(void *arg) {
+    build_job *job = arg;
+    build_merge(job->in, job->src, job->dst, job->lo, job->mid, job->hi);
+    return NULL;
+}
+
+// builds the tree of the sorted keys in [lo, hi) into the job's own root
+static void *build_tree_job(void *arg) {
+    build_job *job = arg;
+    const build_input *in = job->in;
+    critbit_root *root = job->root;
+
+    critbit_node **stack = NULL;
+    int sp = 0, cap = 0;
+    void *pending = NULL;
+    const uint8_t *prev = NULL;
+    size_t prevlen = 0;
+
+    size_t i;
+    for(i = job->lo; i < job->hi; i++) {
+        size_t k = build_index(in, i);
+        const uint8_t *key = in->keys[k];
+        size_t len = in->lens[k];
+
+        critbit_node *node = NULL;
+        uint32_t byte = 0, otherbits = 0;
+        if(prev) {
+            if(key_critbit(prev, prevlen, key, len, &byte, &otherbits))
+                continue;
+
+            if(sp == cap) {
+                int newcap = cap ? cap * 2 : 64;
+                critbit_node **newstack = realloc(stack, newcap * sizeof(critbit_node *));
+                if(!newstack)
+                    goto fail;
+                stack = newstack;
+                cap = newcap;
+            }
+
+            node = alloc_node(root);
+            if(!node)
+                goto fail;
+        }
+
+        void *leaf = new_leaf(root, key, len, in->vals ? in->vals[k] : NULL);
+        if(!leaf) {
+            if(node)
+                free_node(root, node);
+            goto fail;
+        }
+
+        if(node) {
+            node->byte = byte;
+            node->otherbits = otherbits;
+
+            // the spine below the new bit becomes its left subtree
+            while(sp && crit_before(byte, otherbits, stack[sp - 1]->byte, stack[sp - 1]->otherbits)) {
+                critbit_node *q = stack[--sp];
+                q->child[1] = pending;
+                pending = FROM_NODE(q);
+            }
+            node->child[0] = pending;
+            stack[sp++] = node;
+        }
+
+        pending = leaf;
+        prev = key;
+        prevlen = len;
+    }
+
+    if(0) {
+fail:
+        job->failed = 1;
+    }
+
+    // what was built so far is a valid tree either way
+    while(sp) {
+        critbit_node *q = stack[--sp];
+        q->child[1] = pending;
+        pending = FROM_NODE(q);
+    }
+    free(stack);
+
+    job->tree = pending;
+    return NULL;
+}
+
+// runs every job, on its own thread where possible
+static void build_run(void *(*func)(void *), build_job *jobs, int n) {
+    pthread_t threads[BUILD_MAX_THREADS];
+    int started[BUILD_MAX_THREADS];
+
+    int i;
+    for(i = 1; i < n; i++) {
+        started[i] = pthread_create(threads + i, NULL, func, jobs + i) == 0;
+    }
+    func(jobs);
+    for(i = 1; i < n; i++) {
+        if(started[i])
+            pthread_join(threads[i], NULL);
+        else
+            func(jobs + i);
+    }
+}
+
+// sorts runs on separate threads, then merges them pairwise. returns
+// whichever of order and tmp holds the result
+static size_t *build_parallel_sort(const build_input *in, size_t *order, size_t *tmp,
+        size_t n, int nthreads) {
+    build_job jobs[BUILD_MAX_THREADS];
+    size_t bounds[BUILD_MAX_THREADS + 1];
+
+    int i, runs = nthreads;
+    for(i = 0; i <= runs; i++) {
+        bounds[i] = n * i / runs;
+    }
+    for(i = 0; i < runs; i++) {
+        jobs[i].in = in;
+        jobs[i].src = order;
+        jobs[i].dst = tmp;
+        jobs[i].lo = bounds[i];
+        jobs[i].hi = bounds[i + 1];
+    }
+    build_run(build_sort_job, jobs, runs);
+
+    size_t *src = order, *dst = tmp;
+    while(runs > 1) {
+        int merges = (runs + 1) / 2;
+        for(i = 0; i < merges; i++) {
+            jobs[i].in = in;
+            jobs[i].src = src;
+            jobs[i].dst = dst;
+            jobs[i].lo = bounds[2 * i];
+            // an odd run out is merged with nothing, i.e. copied
+            jobs[i].mid = bounds[2 * i + 1];
+            jobs[i].hi = 2 * i + 2 <= runs ? bounds[2 * i + 2] : jobs[i].mid;
+        }
+        build_run(build_merge_job, jobs, merges);
+
+        for(i = 0; i < merges; i++) {
+            bounds[i + 1] = jobs[i].hi;
+        }
+        runs = merges;
+
+        size_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    return src;
+}
+
+// joins two trees, every key of b following those of a. node tests the
+// first bit in which the last key of a and the first one of b differ
+static void *build_join(void *a, critbit_node *node, void *b) {
+    critbit_node *qa = IS_INTERNAL(a) ? TO_NODE(a) : NULL;
+    critbit_node *qb = IS_INTERNAL(b) ? TO_NODE(b) : NULL;
+    if(qa && !crit_before(qa->byte, qa->otherbits, node->byte, node->otherbits))
+        qa = NULL;
+    if(qb && !crit_before(qb->byte, qb->otherbits, node->byte, node->otherbits))
+        qb = NULL;
+
+    // the earliest bit of all stays on top
+    if(qa && (!qb || crit_before(qa->byte, qa->otherbits, qb->byte, qb->otherbits))) {
+        qa->child[1] = build_join(qa->child[1], node, b);
+        return a;
+    }
+    if(qb) {
+        qb->child[0] = build_join(a, node, qb->child[0]);
+        return b;
+    }
+
+    node->child[0] = a;
+    node->child[1] = b;
+    return FROM_NODE(node);
+}
+
+// fills in the counters of a tree that was put together without them.
+// returns the number of keys in it
+static size_t count_tree(critbit_root *root, void *p, int depth) {
+    if(IS_INTERNAL(p)) {
+        critbit_node *node = TO_NODE(p);
+        ++root->node_count;
+        size_t n = count_tree(root, CHILD(node, 0), depth + 1) +
+            count_tree(root, CHILD(node, 1), depth + 1);
+#ifdef CRITBIT_COUNTED
+        node->count = n;
+#endif
+        return n;
+    }
+    if(p) {
+        count_key(root, depth, 1);
+        count_leaf(root, p, 1);
+        return 1;
+    }
+    return 0;
+}
+
+static int build_threads(size_t n) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = n / BUILD_MIN_KEYS;
+    if(cpus > 0 && nthreads > (size_t)cpus)
+        nthreads = cpus;
+    if(nthreads > BUILD_MAX_THREADS)
+        nthreads = BUILD_MAX_THREADS;
+    return nthreads ? nthreads : 1;
+}
+
+critbit_root *critbit_build_len(const void *const *keys, const size_t *lens,
+        void *const *vals, size_t n) {
+    build_input in = {(const uint8_t *const *)keys, lens, vals, NULL};
+    int nthreads = build_threads(n);
+    size_t *order = NULL, *tmp = NULL;
+
+    size_t i;
+    for(i = 1; i < n; i++) {
+        if(build_compare(&in, i - 1, i) > 0)
+            break;
+    }
+    if(i < n) {
+        order = malloc(n * sizeof(size_t));
+        tmp = malloc(n * sizeof(size_t));
+        if(!order || !tmp) {
+            free(order);
+            free(tmp);
+            return NULL;
+        }
+        for(i = 0; i < n; i++) {
+            order[i] = i;
+        }
+        in.order = build_parallel_sort(&in, order, tmp, n, nthreads);
+    }
+
+    // one range of the sorted keys per thread, each built into a private
+    // root. equal keys are never split, the first one has to win
+    build_job jobs[BUILD_MAX_THREADS];
+    critbit_node *joins[BUILD_MAX_THREADS];
+    int j, failed = 0;
+    for(j = 0; j < nthreads; j++) {
+        jobs[j].in = &in;
+        jobs[j].root = critbit_new();
+        jobs[j].tree = NULL;
+        jobs[j].failed = !jobs[j].root;
+        failed |= jobs[j].failed;
+
+        size_t lo = j ? jobs[j - 1].hi : 0;
+        size_t hi = j == nthreads - 1 ? n : n * (j + 1) / nthreads;
+        if(hi < lo)
+            hi = lo;
+        while(hi > 0 && hi < n &&
+                build_compare(&in, build_index(&in, hi - 1), build_index(&in, hi)) == 0) {
+            ++hi;
+        }
+        jobs[j].lo = lo;
+        jobs[j].hi = hi;
+        joins[j] = NULL;
+    }
+
+    critbit_root *root = jobs[0].root;
+    if(!failed) {
+        build_run(build_tree_job, jobs, nthreads);
+
+        for(j = 0; j < nthreads; j++) {
+            failed |= jobs[j].failed;
+            if(failed || !j || !jobs[j].tree)
+                continue;
+            joins[j] = alloc_node(root);
+            failed |= !joins[j];
+        }
+    }
+
+    if(failed) {
+        for(j = 0; j < nthreads; j++) {
+            if(joins[j])
+                free_node(root, joins[j]);
+        }
+        for(j = 0; j < nthreads; j++) {
+            if(!jobs[j].root)
+                continue;
+            jobs[j].root->head = jobs[j].tree;
+            critbit_free(jobs[j].root);
+        }
+        free(order);
+        free(tmp);
+        return NULL;
+    }
+
+    void *tree = jobs[0].tree;
+    for(j = 1; j < nthreads; j++) {
+        if(!jobs[j].tree)
+            continue;
+
+        if(!tree) {
+            tree = jobs[j].tree;
+            free_node(root, joins[j]);
+        } else {
+            size_t a = build_index(&in, jobs[j].lo - 1), b = build_index(&in, jobs[j].lo);
+            // ranges never split equal keys, so these two differ
+            uint32_t byte = 0, otherbits = 0;
+            int equal = key_critbit(in.keys[a], in.lens[a], in.keys[b], in.lens[b],
+                    &byte, &otherbits);
+            assert(!equal);
+            (void)equal;
+            joins[j]->byte = byte;
+            joins[j]->otherbits = otherbits;
+            tree = build_join(tree, joins[j], jobs[j].tree);
+        }
+
+#ifndef CRITBIT_MALLOC
+        slab_adopt(&root->nodes, &jobs[j].root->nodes);
+        slab_arena_adopt(&root->leaves, &jobs[j].root->leaves);
+#endif
+        critbit_free(jobs[j].root);
+    }
+    // the ranges that came out empty have nothing to hand over
+    for(j = 1; j < nthreads; j++) {
+        if(!jobs[j].tree)
+            critbit_free(jobs[j].root);
+    }
+    root->head = tree;
+    count_tree(root, tree, 0);
+
+    free(order);
+    free(tmp);
+    return root;
+}
+
+critbit_root *critbit_build(const char *const *keys, void *const *vals, size_t n) {
+    size_t *lens = malloc((n ? n : 1) * sizeof(size_t));
+    if(!lens)
+        return NULL;
+
+    size_t i;
+    for(i = 0; i < n; i++) {
+        lens[i] = strlen(keys[i]);
+    }
+
+    critbit_root *root = critbit_build_len((const void *const *)keys, lens, vals, n);
+    free(lens);
+    return root;
+}
+
+// Set operations. Both trees are walked at once, a pair of subtrees at a
+// time. The leftmost keys of the two tell where they part: before the bits
+// both subtrees test, their keys are disjoint and one of them is taken or
+// dropped whole. Otherwise the subtree testing the earlier bit has the
+// other one entirely on one side, or both test the same bit and their
+// children are paired up. The result comes out in order, so it's either
+// handed to a callback or put together bottom up into a new tree, which is
+// canonical like any other.
+enum {
+    SETOP_UNION,
+    SETOP_INTERSECT,
+    SETOP_DIFFERENCE,
+};
+
+typedef struct setop {
+    int op;
+    // the tree being built, NULL to call cb instead
+    critbit_root *dest;
+    critbit_callback cb;
+    void *data;
+    // the return of the callback that stopped the walk, -1 if out of memory
+    int ret;
+} setop;
+
+static void *setop_leaf(setop *s, void *p) {
+    leaf_view view;
+    leaf_load(&view, p);
+    if(!s->dest) {
+        s->ret = s->cb(s->data, (const char *)view.key, view.len, view.value);
+        return NULL;
+    }
+    void *x = new_leaf(s->dest, view.key, view.len, view.value);
+    if(!x)
+        s->ret = -1;
+    return x;
+}
+
+// a node testing byte and otherbits over x and y, either of which may be
+// missing. what was built stays reachable even if that fails
+static void *setop_join(setop *s, void *x, uint32_t byte, uint32_t otherbits, void *y) {
+    if(!x)
+        return y;
+    if(!y)
+        return x;
+
+    critbit_node *node = alloc_node(s->dest);
+    if(!node) {
+        s->ret = -1;
+#ifdef CRITBIT_MALLOC
+        clear_tree(s->dest, y);
+#endif
+        return x;
+    }
+    node->byte = byte;
+    node->otherbits = otherbits;
+    node->child[0] = x;
+    node->child[1] = y;
+    return FROM_NODE(node);
+}
+
+// every key of the subtree at p
+static void *setop_take(setop *s, void *p) {
+    if(s->ret)
+        return NULL;
+    if(!IS_INTERNAL(p))
+        return setop_leaf(s, p);
+
+    critbit_node *node = TO_NODE(p);
+    void *x = setop_take(s, CHILD(node, 0));
+    void *y = setop_take(s, CHILD(node, 1));
+    return setop_join(s, x, node->byte, node->otherbits, y);
+}
+
+static void *setop_merge(setop *s, void *p, void *q) {
+    if(s->ret)
+        return NULL;
+    if(!p)
+        return q && s->op == SETOP_UNION ? setop_take(s, q) : NULL;
+    if(!q)
+        return s->op != SETOP_INTERSECT ? setop_take(s, p) : NULL;
+
+    critbit_node *a = IS_INTERNAL(p) ? TO_NODE(p) : NULL;
+    critbit_node *b = IS_INTERNAL(q) ? TO_NODE(q) : NULL;
+
+    leaf_view lp, lq;
+    leaf_load(&lp, extreme_leaf(p, 0));
+    leaf_load(&lq, extreme_leaf(q, 0));
+    uint32_t byte = 0, otherbits = 0;
+    int exact = key_critbit(lp.key, lp.len, lq.key, lq.len, &byte, &otherbits);
+
+    // apart before either subtree tests a bit
+    if(!exact && (!a || crit_before(byte, otherbits, a->byte, a->otherbits)) &&
+            (!b || crit_before(byte, otherbits, b->byte, b->otherbits))) {
+        if(s->op == SETOP_INTERSECT)
+            return NULL;
+        if(s->op == SETOP_DIFFERENCE)
+            return setop_take(s, p);
+        int first = key_direction(byte, otherbits, lp.key, lp.len);
+        void *x = setop_take(s, first ? q : p);
+        void *y = setop_take(s, first ? p : q);
+        return setop_join(s, x, byte, otherbits, y);
+    }
+
+    if(!a && !b)
+        return s->op != SETOP_DIFFERENCE ? setop_leaf(s, p) : NULL;
+
+    void *x, *y;
+    if(a && b && a->byte == b->byte && a->otherbits == b->otherbits) {
+        x = setop_merge(s, CHILD(a, 0), CHILD(b, 0));
+        y = setop_merge(s, CHILD(a, 1), CHILD(b, 1));
+        return setop_join(s, x, a->byte, a->otherbits, y);
+    }
+
+    if(a && (!b || crit_before(a->byte, a->otherbits, b->byte, b->otherbits))) {
+        // q is on one side of the bit a tests
+        int dir = key_direction(a->byte, a->otherbits, lq.key, lq.len);
+        int keep = s->op != SETOP_INTERSECT;
+        if(dir) {
+            x = keep ? setop_take(s, CHILD(a, 0)) : NULL;
+            y = setop_merge(s, CHILD(a, 1), q);
+        } else {
+            x = setop_merge(s, CHILD(a, 0), q);
+            y = keep ? setop_take(s, CHILD(a, 1)) : NULL;
+        }
+        return setop_join(s, x, a->byte, a->otherbits, y);
+    }
+
+    // p is on one side of the bit b tests
+    int dir = key_direction(b->byte, b->otherbits, lp.key, lp.len);
+    if(s->op != SETOP_UNION)
+        return setop_merge(s, p, CHILD(b, dir));
+    if(dir) {
+        x = setop_take(s, CHILD(b, 0));
+        y = setop_merge(s, p, CHILD(b, 1));
+    } else {
+        x = setop_merge(s, p, CHILD(b, 0));
+        y = setop_take(s, CHILD(b, 1));
+    }
+    return setop_join(s, x, b->byte, b->otherbits, y);
+}
+
+static critbit_root *setop_tree(critbit_root *a, critbit_root *b, int op) {
+    setop s = {op, critbit_new(), NULL, NULL, 0};
+    if(!s.dest)
+        return NULL;
+
+    read_begin(a);
+    read_begin(b);
+    void *tree = setop_merge(&s, a->head, b->head);
+    read_end(b);
+    read_end(a);
+
+    s.dest->head = tree;
+    if(s.ret) {
+        critbit_free(s.dest);
+        return NULL;
+    }
+    count_tree(s.dest, tree, 0);
+    return s.dest;
+}
+
+static int setop_iter(critbit_root *a, critbit_root *b, int op,
+        critbit_callback cb, void *data) {
+    setop s = {op, NULL, cb, data, 0};
+    read_begin(a);
+    read_begin(b);
+    setop_merge(&s, a->head, b->head);
+    read_end(b);
+    read_end(a);
+    return s.ret;
+}
+
+critbit_root *critbit_union(critbit_root *a, critbit_root *b) {
+    return setop_tree(a, b, SETOP_UNION);
+}
+
+critbit_root *critbit_intersect(critbit_root *a, critbit_root *b) {
+    return setop_tree(a, b, SETOP_INTERSECT);
+}
+
+critbit_root *critbit_difference(critbit_root *a, critbit_root *b) {
+    return setop_tree(a, b, SETOP_DIFFERENCE);
+}
+
+int critbit_union_iter(critbit_root *a, critbit_root *b, critbit_callback cb, void *data) {
+    return setop_iter(a, b, SETOP_UNION, cb, data);
+}
+
+int critbit_intersect_iter(critbit_root *a, critbit_root *b, critbit_callback cb, void *data) {
+    return setop_iter(a, b, SETOP_INTERSECT, cb, data);
+}
+
+int critbit_difference_iter(critbit_root *a, critbit_root *b, critbit_callback cb, void *data) {
+    return setop_iter(a, b, SETOP_DIFFERENCE, cb, data);
+}
+
+// On-disk images. Nodes and leaves are written children first, so a node
+// only refers to offsets that are already known, and the whole file is
+// written in one sequential pass. A reference is the offset of a leaf, the
+// offset of a node with the low bit set, or an inline leaf as it is. The
+// image is used straight from the mapping, without any parsing.
+#define IMAGE_MAGIC "critbit\001"
+#define IMAGE_VERSION 1
+
+typedef struct image_header {
+    char magic[8];
+    uint32_t version;
+    // inline leaves and values are only meaningful with the same word size
+    uint32_t word_size;
+    uint64_t size;
+    uint64_t head;
+    uint64_t keys;
+} image_header;
+
+typedef struct image_node {
+    uint64_t child[2];
+    uint32_t byte;
+    uint16_t otherbits;
+    uint16_t pad;
+} image_node;
+
+typedef struct image_leaf {
+    uint64_t value;
+    uint32_t len;
+    uint8_t key[];
+} image_leaf;
+
+#define IMAGE_ALIGN(size) (((size) + 7) & ~(uint64_t)7)
+#define IMAGE_LEAF_SIZE(len) IMAGE_ALIGN(sizeof(image_leaf) + (len) + 1)
+
+struct critbit_image {
+    const uint8_t *base;
+    size_t size;
+    uint64_t head;
+    // writes land here, a tombstone value hides a key of the image
+    critbit_root *overlay;
+};
+
+static char image_tombstone;
+#define TOMBSTONE ((void *)&image_tombstone)
+
+typedef struct image_frame {
+    void *p;
+    uint64_t child[2];
+    int state;
+} image_frame;
+
+static int image_write(FILE *f, const void *p, size_t size, uint64_t *pos) {
+    static const uint8_t zero[8];
+    size_t padded = IMAGE_ALIGN(size);
+    if(fwrite(p, 1, size, f) != size || fwrite(zero, 1, padded - size, f) != padded - size)
+        return 1;
+    *pos += padded;
+    return 0;
+}
+
+// writes the tree at head, returns the reference to it in out
+static int image_write_tree(FILE *f, void *head, uint64_t *pos,
+        uint64_t *out, uint64_t *keys) {
+    image_frame *stack = NULL;
+    int sp = 0, cap = 0, ret = 1;
+    uint8_t *buf = NULL;
+    size_t bufcap = 0;
+    uint64_t ref = 0;
+
+    if(!head) {
+        *out = 0;
+        return 0;
+    }
+
+    void *p = head;
+    for(;;) {
+        // go down to the leftmost leaf below p, pushing the nodes
+        while(IS_INTERNAL(p)) {
+            if(sp == cap) {
+                int newcap = cap ? cap * 2 : 64;
+                image_frame *newstack = realloc(stack, newcap * sizeof(image_frame));
+                if(!newstack)
+                    goto out;
+                stack = newstack;
+                cap = newcap;
+            }
+            stack[sp].p = p;
+            stack[sp].state = 0;
+            ++sp;
+            p = CHILD((critbit_node *)TO_NODE(p), 0);
+        }
+
+        ++*keys;
+        if(IS_INLINE(p)) {
+            ref = (uint64_t)(size_t)UNMARK(p);
+        } else {
+            critbit_leaf *leaf = UNMARK(p);
+            size_t size = sizeof(image_leaf) + leaf->len + 1;
+            if(size > bufcap) {
+                uint8_t *newbuf = realloc(buf, size);
+                if(!newbuf)
+                    goto out;
+                buf = newbuf;
+                bufcap = size;
+            }
+            image_leaf *rec = (image_leaf *)buf;
+            memset(rec, 0, sizeof(image_leaf));
+            rec->value = (uint64_t)(size_t)leaf->value;
+            rec->len = leaf->len;
+            memcpy(rec->key, leaf->key, leaf->len + 1);
+
+            ref = *pos;
+            if(image_write(f, buf, size, pos))
+                goto out;
+        }
+
+        // hand the reference up, writing every node that is complete now
+        for(;;) {
+            if(!sp) {
+                *out = ref;
+                ret = 0;
+                goto out;
+            }
+            image_frame *frame = &stack[sp - 1];
+            frame->child[frame->state++] = ref;
+            if(frame->state == 1) {
+                p = CHILD((critbit_node *)TO_NODE(frame->p), 1);
+                break;
+            }
+
+            critbit_node *node = TO_NODE(frame->p);
+            image_node rec;
+            rec.child[0] = frame->child[0];
+            rec.child[1] = frame->child[1];
+            rec.byte = node->byte;
+            rec.otherbits = node->otherbits;
+            rec.pad = 0;
+
+            ref = *pos | 1;
+            if(image_write(f, &rec, sizeof(rec), pos))
+                goto out;
+            --sp;
+        }
+    }
+
+out:
+    free(stack);
+    free(buf);
+    return ret;
+}
+
+int critbit_save(critbit_root *root, const char *path) {
+    size_t len = strlen(path);
+    char *tmp = malloc(len + 5);
+    if(!tmp)
+        return 1;
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    FILE *f = fopen(tmp, "wb");
+    if(!f) {
+        free(tmp);
+        return 1;
+    }
+
+    // a snapshot keeps the image consistent while writers carry on
+    critbit_view *view = critbit_snapshot(root);
+    image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.word_size = sizeof(void *);
+
+    uint64_t pos = 0;
+    int ret = !view || image_write(f, &header, sizeof(header), &pos);
+    if(!ret)
+        ret = image_write_tree(f, view->head, &pos, &header.head, &header.keys);
+    critbit_snapshot_release(view);
+
+    // the header goes in last, with the size and head filled in
+    if(!ret) {
+        header.size = pos;
+        ret = fseek(f, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, f) != 1;
+    }
+    if(fflush(f) || fsync(fileno(f)))
+        ret = 1;
+    if(fclose(f))
+        ret = 1;
+
+    // the old image stays in place until the new one is complete
+    if(!ret && rename(tmp, path))
+        ret = 1;
+    if(ret)
+        unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+// whether a reference from the header points into an image of size bytes.
+// an inline leaf is the key word itself, not an offset
+static int image_ref_valid(uint64_t ref, uint64_t size) {
+    if(!ref || IS_INLINE(ref))
+        return 1;
+    if(IS_INTERNAL(ref))
+        return size >= sizeof(image_node) && (ref & ~(uint64_t)1) <= size - sizeof(image_node);
+    return size >= sizeof(image_leaf) && ref <= size - sizeof(image_leaf);
+}
+
+critbit_image *critbit_open_mmap(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    struct stat st;
+    critbit_image *img = NULL;
+    const image_header *header;
+    void *base = MAP_FAILED;
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(image_header))
+        goto fail;
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED)
+        goto fail;
+
+    header = base;
+    if(memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) ||
+            header->version != IMAGE_VERSION ||
+            header->word_size != sizeof(void *) ||
+            header->size != (uint64_t)st.st_size ||
+            !image_ref_valid(header->head, header->size))
+        goto fail;
+
+    img = malloc(sizeof(critbit_image));
+    if(!img)
+        goto fail;
+    img->overlay = critbit_new();
+    if(!img->overlay)
+        goto fail;
+
+    img->base = base;
+    img->size = st.st_size;
+    img->head = header->head;
+    close(fd);
+    return img;
+
+fail:
+    free(img);
+    if(base != MAP_FAILED)
+        munmap(base, st.st_size);
+    close(fd);
+    return NULL;
+}
+
+void critbit_image_close(critbit_image *img) {
+    if(!img)
+        return;
+    critbit_free(img->overlay);
+    munmap((void *)img->base, img->size);
+    free(img);
+}
+
+critbit_root *critbit_image_overlay(critbit_image *img) {
+    return img->overlay;
+}
+
+static inline const image_node *image_node_at(const critbit_image *img, uint64_t ref) {
+    return (const image_node *)(img->base + (ref & ~(uint64_t)1));
+}
+
+static inline void image_leaf_load(const critbit_image *img, leaf_view *view, uint64_t ref) {
+    if(IS_INLINE(ref)) {
+        leaf_load(view, (void *)(size_t)ref);
+        return;
+    }
+    const image_leaf *leaf = (const image_leaf *)(img->base + ref);
+    view->key = leaf->key;
+    view->len = leaf->len;
+    view->value = (void *)(size_t)leaf->value;
+}
+
+static uint64_t image_nearest(const critbit_image *img, const uint8_t *bytes, size_t len) {
+    uint64_t ref = img->head;
+    while(IS_INTERNAL(ref)) {
+        const image_node *node = image_node_at(img, ref);
+        ref = node->child[key_direction(node->byte, node->otherbits, bytes, len)];
+    }
+    return ref;
+}
+
+static int image_get(const critbit_image *img, const uint8_t *bytes, size_t len, void **out) {
+    if(!img->head)
+        return 1;
+
+    leaf_view leaf;
+    image_leaf_load(img, &leaf, image_nearest(img, bytes, len));
+    if(leaf.len != len || memcmp(leaf.key, bytes, len) != 0)
+        return 1;
+    *out = leaf.value;
+    return 0;
+}
+
+// In order iteration over the leaves of the image. The stack holds the
+// subtrees still to visit, the next one on top.
+typedef struct image_iter {
+    const critbit_image *img;
+    uint64_t *stack;
+    int sp, cap;
+} image_iter;
+
+static int image_iter_push(image_iter *it, uint64_t ref) {
+    if(it->sp == it->cap) {
+        int cap = it->cap ? it->cap * 2 : 64;
+        uint64_t *stack = realloc(it->stack, cap * sizeof(uint64_t));
+        if(!stack)
+            return 1;
+        it->stack = stack;
+        it->cap = cap;
+    }
+    it->stack[it->sp++] = ref;
+    return 0;
+}
+
+// positions the iterator at the first key >= key
+static int image_iter_seek(image_iter *it, const critbit_image *img,
+        const uint8_t *bytes, size_t len) {
+    memset(it, 0, sizeof(*it));
+    it->img = img;
+    if(!img->head)
+        return 0;
+    if(!bytes)
+        return image_iter_push(it, img->head);
+
+    leaf_view leaf;
+    image_leaf_load(img, &leaf, image_nearest(img, bytes, len));
+    uint32_t critbyte, critother;
+    int exact = key_critbit(leaf.key, leaf.len, bytes, len, &critbyte, &critother);
+
+    // above the critical bit the key agrees with every key below, so its
+    // direction splits them into smaller and larger ones
+    uint64_t ref = img->head;
+    while(IS_INTERNAL(ref)) {
+        const image_node *node = image_node_at(img, ref);
+        if(!exact && !crit_before(node->byte, node->otherbits, critbyte, critother))
+            break;
+        int dir = key_direction(node->byte, node->otherbits, bytes, len);
+        if(!dir && image_iter_push(it, node->child[1]))
+            return 1;
+        ref = node->child[dir];
+    }
+
+    // below it, everything is on the same side of the key
+    if(exact || !key_direction(critbyte, critother, bytes, len))
+        return image_iter_push(it, ref);
+    return 0;
+}
+
+// returns 1 when there are no more keys
+static int image_iter_next(image_iter *it, leaf_view *out) {
+    while(it->sp) {
+        uint64_t ref = it->stack[--it->sp];
+        while(IS_INTERNAL(ref)) {
+            const image_node *node = image_node_at(it->img, ref);
+            if(image_iter_push(it, node->child[1])) {
+                it->sp = 0;
+                return 1;
+            }
+            ref = node->child[0];
+        }
+        image_leaf_load(it->img, out, ref);
+        return 0;
+    }
+    return 1;
+}
+
+int critbit_image_get_len(critbit_image *img, const void *key, size_t len, void **out) {
+    void *value;
+    if(!critbit_get_len(img->overlay, key, len, &value)) {
+        if(value == TOMBSTONE)
+            return 1;
+        *out = value;
+        return 0;
+    }
+    return image_get(img, key, len, out);
+}
+
+int critbit_image_get(critbit_image *img, const char *key, void **out) {
+    return critbit_image_get_len(img, key, strlen(key), out);
+}
+
+int critbit_image_put_len(critbit_image *img, const void *key, size_t len, const void *value) {
+    return critbit_upsert_len(img->overlay, key, len, value, NULL) < 0;
+}
+
+int critbit_image_put(critbit_image *img, const char *key, const void *value) {
+    return critbit_image_put_len(img, key, strlen(key), value);
+}
+
+int critbit_image_delete_len(critbit_image *img, const void *key, size_t len) {
+    void *value;
+    if(image_get(img, key, len, &value))
+        return critbit_delete_len(img->overlay, key, len);
+
+    void *old = NULL;
+    int ret = critbit_upsert_len(img->overlay, key, len, TOMBSTONE, &old);
+    return ret < 0 || (ret == 1 && old == TOMBSTONE);
+}
+
+int critbit_image_delete(critbit_image *img, const char *key) {
+    return critbit_image_delete_len(img, key, strlen(key));
+}
+
+// Merges the image and the overlay from lo on. The overlay wins on equal
+// keys, and its tombstones hide the keys of the image. Stops at hi, or at
+// the first key without the prefix.
+static int image_scan(critbit_image *img, const void *lo, size_t lolen,
+        const void *hi, size_t hilen, const void *prefix, size_t prefix_len,
+        critbit_callback cb, void *data) {
+    image_iter it = { 0 };
+    critbit_cursor *cur = critbit_seek_len(img->overlay, lo ? lo : "", lo ? lolen : 0);
+    if(!cur || image_iter_seek(&it, img, lo, lolen)) {
+        critbit_cursor_free(cur);
+        free(it.stack);
+        return 0;
+    }
+
+    leaf_view leaf;
+    int have = !image_iter_next(&it, &leaf), ret = 0;
+    for(;;) {
+        size_t len;
+        const uint8_t *key = (const uint8_t *)critbit_cursor_key(cur, &len);
+        void *value = critbit_cursor_value(cur);
+        int c = !key ? -1 : !have ? 1 : key_compare(leaf.key, leaf.len, key, len);
+        if(c < 0) {
+            if(!have)
+                break;
+            key = leaf.key;
+            len = leaf.len;
+            value = leaf.value;
+        }
+
+        if(hi && key_compare(key, len, hi, hilen) >= 0)
+            break;
+        if(prefix && (len < prefix_len || memcmp(key, prefix, prefix_len) != 0))
+            break;
+        if(value != TOMBSTONE) {
+            ret = cb(data, (const char *)key, len, value);
+            if(ret)
+                break;
+        }
+
+        if(c <= 0)
+            have = !image_iter_next(&it, &leaf);
+        if(c >= 0)
+            critbit_next(cur);
+    }
+
+    critbit_cursor_free(cur);
+    free(it.stack);
+    return ret;
+}
+
+int critbit_image_range_len(critbit_image *img,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data) {
+    return image_scan(img, lo, lolen, hi, hilen, NULL, 0, cb, data);
+}
+
+int critbit_image_range(critbit_image *img, const char *lo, const char *hi,
+        critbit_callback cb, void *data) {
+    return critbit_image_range_len(img, lo, lo ? strlen(lo) : 0,
+            hi, hi ? strlen(hi) : 0, cb, data);
+}
+
+int critbit_image_iter_prefix(critbit_image *img, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data) {
+    return image_scan(img, prefix, prefix_len, NULL, 0, prefix, prefix_len, cb, data);
+}
+
+// A frozen tree has no pointers. Its shape is one bit per node in level
+// order, set for internal nodes: with the root at 0, the children of the
+// internal node at p are at 2 * rank1(p) + 1 and + 2, and the leaf at p is
+// leaf number p - rank1(p). Critical bits are packed as byte * 9 + bit in
+// as few bits as the longest key needs. Keys are concatenated in leaf
+// order, with their offsets Elias-Fano coded.
+struct critbit_frozen {
+    size_t nkeys;
+    bitvec shape;
+    packed_ints crit;
+    elias_fano offsets;
+    uint8_t *keys;
+    packed_ints values;
+    uint32_t max_len;
+};
+
+// the bit is counted from the top, so packed positions sort like crit_before
+static inline uint32_t crit_pack(uint32_t byte, uint32_t otherbits) {
+    return byte * 9 + 8 - __builtin_ctz(~otherbits & 0x1FF);
+}
+
+static inline void crit_unpack(uint32_t crit, uint32_t *byte, uint32_t *otherbits) {
+    *byte = crit / 9;
+    *otherbits = 0x1FF ^ (1 << (8 - crit % 9));
+}
+
+void critbit_frozen_free(critbit_frozen *f) {
+    if(!f)
+        return;
+    bitvec_free(&f->shape);
+    packed_free(&f->crit);
+    ef_free(&f->offsets);
+    free(f->keys);
+    packed_free(&f->values);
+    free(f);
+}
+
+critbit_frozen *critbit_freeze(critbit_root *root) {
+    critbit_frozen *f = calloc(1, sizeof(critbit_frozen));
+    critbit_view *view = critbit_snapshot(root);
+    void **queue = NULL;
+    uint64_t *offsets = NULL;
+    size_t n = 0, cap = 0, i;
+    if(!f || !view)
+        goto fail;
+
+    // lay the nodes out in level order
+    if(view->head) {
+        cap = 64;
+        queue = malloc(cap * sizeof(void *));
+        if(!queue)
+            goto fail;
+        queue[n++] = view->head;
+    }
+    for(i = 0; i < n; i++) {
+        if(!IS_INTERNAL(queue[i]))
+            continue;
+        if(n + 2 > cap) {
+            void **newqueue = realloc(queue, cap * 2 * sizeof(void *));
+            if(!newqueue)
+                goto fail;
+            queue = newqueue;
+            cap *= 2;
+        }
+        critbit_node *node = TO_NODE(queue[i]);
+        queue[n++] = CHILD(node, 0);
+        queue[n++] = CHILD(node, 1);
+    }
+
+    // sizes first, so every field gets the width it needs
+    uint32_t max_crit = 0;
+    uint64_t max_value = 0, key_bytes = 0;
+    leaf_view leaf;
+    for(i = 0; i < n; i++) {
+        if(IS_INTERNAL(queue[i])) {
+            critbit_node *node = TO_NODE(queue[i]);
+            uint32_t crit = crit_pack(node->byte, node->otherbits);
+            if(crit > max_crit)
+                max_crit = crit;
+            continue;
+        }
+        leaf_load(&leaf, queue[i]);
+        ++f->nkeys;
+        key_bytes += leaf.len;
+        if((size_t)leaf.value > max_value)
+            max_value = (size_t)leaf.value;
+        if(leaf.len > f->max_len)
+            f->max_len = leaf.len;
+    }
+
+    offsets = malloc((f->nkeys + 1) * sizeof(uint64_t));
+    f->keys = malloc(key_bytes ? key_bytes : 1);
+    if(!offsets || !f->keys || bitvec_init(&f->shape, n) ||
+            packed_init(&f->crit, n - f->nkeys, bits_needed(max_crit)) ||
+            packed_init(&f->values, f->nkeys, bits_needed(max_value)))
+        goto fail;
+
+    size_t nodes = 0, keys = 0;
+    uint64_t pos = 0;
+    for(i = 0; i < n; i++) {
+        if(IS_INTERNAL(queue[i])) {
+            critbit_node *node = TO_NODE(queue[i]);
+            bitvec_set(&f->shape, i);
+            packed_set(&f->crit, nodes++, crit_pack(node->byte, node->otherbits));
+            continue;
+        }
+        leaf_load(&leaf, queue[i]);
+        memcpy(f->keys + pos, leaf.key, leaf.len);
+        offsets[keys] = pos;
+        packed_set(&f->values, keys++, (size_t)leaf.value);
+        pos += leaf.len;
+    }
+    offsets[keys] = pos;
+
+    if(bitvec_index(&f->shape) || ef_init(&f->offsets, offsets, f->nkeys + 1))
+        goto fail;
+
+    free(queue);
+    free(offsets);
+    critbit_snapshot_release(view);
+    return f;
+
+fail:
+    free(queue);
+    free(offsets);
+    critbit_snapshot_release(view);
+    critbit_frozen_free(f);
+    return NULL;
+}
+
+void critbit_frozen_stats(critbit_frozen *f, critbit_frozen_statistics *out) {
+    out->keys = f->nkeys;
+    out->structure_bytes = sizeof(critbit_frozen) + bitvec_bytes(&f->shape) +
+        packed_bytes(&f->crit) + ef_bytes(&f->offsets);
+    out->key_bytes = f->nkeys ? ef_get(&f->offsets, f->nkeys) : 0;
+    out->value_bytes = packed_bytes(&f->values);
+}
+
+static inline int frozen_is_node(const critbit_frozen *f, size_t pos) {
+    return bitvec_get(&f->shape, pos);
+}
+
+static inline size_t frozen_child(const critbit_frozen *f, size_t pos, int dir) {
+    return 2 * bitvec_rank1(&f->shape, pos) + 1 + dir;
+}
+
+static inline void frozen_crit(const critbit_frozen *f, size_t pos,
+        uint32_t *byte, uint32_t *otherbits) {
+    crit_unpack(packed_get(&f->crit, bitvec_rank1(&f->shape, pos)), byte, otherbits);
+}
+
+static void frozen_leaf(const critbit_frozen *f, size_t pos, leaf_view *view) {
+    size_t i = pos - bitvec_rank1(&f->shape, pos);
+    uint64_t start, end;
+    ef_get_pair(&f->offsets, i, &start, &end);
+    view->key = f->keys + start;
+    view->len = end - start;
+    view->value = (void *)(size_t)packed_get(&f->values, i);
+}
+
+static size_t frozen_nearest(const critbit_frozen *f, const uint8_t *bytes, size_t len) {
+    size_t pos = 0;
+    while(frozen_is_node(f, pos)) {
+        size_t rank = bitvec_rank1(&f->shape, pos);
+        uint32_t byte, otherbits;
+        crit_unpack(packed_get(&f->crit, rank), &byte, &otherbits);
+        pos = 2 * rank + 1 + key_direction(byte, otherbits, bytes, len);
+    }
+    return pos;
+}
+
+int critbit_frozen_get_len(critbit_frozen *f, const void *key, size_t len, void **out) {
+    if(!f->nkeys)
+        return 1;
+
+    leaf_view leaf;
+    frozen_leaf(f, frozen_nearest(f, key, len), &leaf);
+    if(leaf.len != len || memcmp(leaf.key, key, len) != 0)
+        return 1;
+    *out = leaf.value;
+    return 0;
+}
+
+int critbit_frozen_get(critbit_frozen *f, const char *key, void **out) {
+    return critbit_frozen_get_len(f, key, strlen(key), out);
+}
+
+// In order iteration over the leaves, the subtrees still to visit are on
+// the stack with the next one on top
+typedef struct frozen_iter {
+    const critbit_frozen *f;
+    size_t *stack;
+    int sp, cap;
+} frozen_iter;
+
+static int frozen_iter_push(frozen_iter *it, size_t pos) {
+    if(it->sp == it->cap) {
+        int cap = it->cap ? it->cap * 2 : 64;
+        size_t *stack = realloc(it->stack, cap * sizeof(size_t));
+        if(!stack)
+            return 1;
+        it->stack = stack;
+        it->cap = cap;
+    }
+    it->stack[it->sp++] = pos;
+    return 0;
+}
+
+// positions the iterator at the first key >= key, see image_iter_seek
+static int frozen_iter_seek(frozen_iter *it, const critbit_frozen *f,
+        const uint8_t *bytes, size_t len) {
+    memset(it, 0, sizeof(*it));
+    it->f = f;
+    if(!f->nkeys)
+        return 0;
+    if(!bytes)
+        return frozen_iter_push(it, 0);
+
+    leaf_view leaf;
+    frozen_leaf(f, frozen_nearest(f, bytes, len), &leaf);
+    uint32_t critbyte = 0, critother = 0;
+    int exact = key_critbit(leaf.key, leaf.len, bytes, len, &critbyte, &critother);
+
+    size_t pos = 0;
+    while(frozen_is_node(f, pos)) {
+        uint32_t byte, otherbits;
+        frozen_crit(f, pos, &byte, &otherbits);
+        if(!exact && !crit_before(byte, otherbits, critbyte, critother))
+            break;
+        int dir = key_direction(byte, otherbits, bytes, len);
+        if(!dir && frozen_iter_push(it, frozen_child(f, pos, 1)))
+            return 1;
+        pos = frozen_child(f, pos, dir);
+    }
+
+    if(exact || !key_direction(critbyte, critother, bytes, len))
+        return frozen_iter_push(it, pos);
+    return 0;
+}
+
+// returns 1 when there are no more keys
+static int frozen_iter_next(frozen_iter *it, leaf_view *out) {
+    while(it->sp) {
+        size_t pos = it->stack[--it->sp];
+        while(frozen_is_node(it->f, pos)) {
+            if(frozen_iter_push(it, frozen_child(it->f, pos, 1))) {
+                it->sp = 0;
+                return 1;
+            }
+            pos = frozen_child(it->f, pos, 0);
+        }
+        frozen_leaf(it->f, pos, out);
+        return 0;
+    }
+    return 1;
+}
+
+// calls cb from lo on, up to hi or the first key without the prefix
+static int frozen_scan(critbit_frozen *f, const void *lo, size_t lolen,
+        const void *hi, size_t hilen, const void *prefix, size_t prefix_len,
+        critbit_callback cb, void *data) {
+    // keys are handed out NUL terminated like everywhere else
+    char *buf = malloc(f->max_len + 1);
+    frozen_iter it = { 0 };
+    if(!buf || frozen_iter_seek(&it, f, lo, lolen)) {
+        free(buf);
+        free(it.stack);
+        return 0;
+    }
+
+    leaf_view leaf;
+    int ret = 0;
+    while(!frozen_iter_next(&it, &leaf)) {
+        if(hi && key_compare(leaf.key, leaf.len, hi, hilen) >= 0)
+            break;
+        if(prefix && (leaf.len < prefix_len || memcmp(leaf.key, prefix, prefix_len) != 0))
+            break;
+        memcpy(buf, leaf.key, leaf.len);
+        buf[leaf.len] = '\0';
+        ret = cb(data, buf, leaf.len, leaf.value);
+        if(ret)
+            break;
+    }
+
+    free(buf);
+    free(it.stack);
+    return ret;
+}
+
+int critbit_frozen_range_len(critbit_frozen *f,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data) {
+    return frozen_scan(f, lo, lolen, hi, hilen, NULL, 0, cb, data);
+}
+
+int critbit_frozen_range(critbit_frozen *f, const char *lo, const char *hi,
+        critbit_callback cb, void *data) {
+    return critbit_frozen_range_len(f, lo, lo ? strlen(lo) : 0,
+            hi, hi ? strlen(hi) : 0, cb, data);
+}
+
+int critbit_frozen_iter_prefix(critbit_frozen *f, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data) {
+    return frozen_scan(f, prefix, prefix_len, NULL, 0, prefix, prefix_len, cb, data);
+}
+
+// Integer keyed trees, one instance of critbit_int.h per width
+#define CRITBIT_INT_NAME u32
+#define CRITBIT_INT_TYPE uint32_t
+#include "critbit_int.h"
+
+#define CRITBIT_INT_NAME u64
+#define CRITBIT_INT_TYPE uint64_t
+#include "critbit_int.h"
+
+#define CRITBIT_INT_NAME u128
+#define CRITBIT_INT_TYPE unsigned __int128
+#include "critbit_int.h"
+
+// Keys are routed by the leading bits of their first byte, so shard i only
+// holds keys that sort before those of shard i + 1. The empty key goes to
+// shard 0.
+struct critbit_sharded {
+    int shift;
+    int nshards;
+    critbit_root *shards[];
+};
+
+critbit_sharded *critbit_sharded_new(int nshards) {
+    int bits = 0;
+    while((1 << bits) < nshards && bits < 8)
+        ++bits;
+    nshards = 1 << bits;
+
+    critbit_sharded *map = malloc(sizeof(critbit_sharded) + nshards * sizeof(critbit_root *));
+    if(!map)
+        return NULL;
+    map->shift = 8 - bits;
+    map->nshards = nshards;
+
+    int i;
+    for(i = 0; i < nshards; i++) {
+        map->shards[i] = critbit_new();
+        if(!map->shards[i]) {
+            map->nshards = i;
+            critbit_sharded_free(map);
+            return NULL;
+        }
+    }
+    return map;
+}
+
+int critbit_sharded_count(critbit_sharded *map) {
+    return map->nshards;
+}
+
+critbit_root *critbit_sharded_shard(critbit_sharded *map, int i) {
+    return map->shards[i];
+}
+
+static int shard_index(critbit_sharded *map, const void *key, size_t len) {
+    if(!len)
+        return 0;
+    return *(const uint8_t *)key >> map->shift;
+}
+
+static critbit_root *shard_of(critbit_sharded *map, const void *key, size_t len) {
+    return map->shards[shard_index(map, key, len)];
+}
+
+int critbit_sharded_insert_len(critbit_sharded *map, const void *key, size_t len, const void *value) {
+    return critbit_insert_len(shard_of(map, key, len), key, len, value);
+}
+
+int critbit_sharded_insert(critbit_sharded *map, const char *key, const void *value) {
+    return critbit_sharded_insert_len(map, key, strlen(key), value);
+}
+
+int critbit_sharded_get_len(critbit_sharded *map, const void *key, size_t len, void **out) {
+    return critbit_get_len(shard_of(map, key, len), key, len, out);
+}
+
+int critbit_sharded_get(critbit_sharded *map, const char *key, void **out) {
+    return critbit_sharded_get_len(map, key, strlen(key), out);
+}
+
+int critbit_sharded_delete_len(critbit_sharded *map, const void *key, size_t len) {
+    return critbit_delete_len(shard_of(map, key, len), key, len);
+}
+
+int critbit_sharded_delete(critbit_sharded *map, const char *key) {
+    return critbit_sharded_delete_len(map, key, strlen(key));
+}
+
+int critbit_sharded_range_len(critbit_sharded *map,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data) {
+    int first = lo ? shard_index(map, lo, lolen) : 0;
+    int last = hi ? shard_index(map, hi, hilen) : map->nshards - 1;
+
+    int i, ret = 0;
+    for(i = first; i <= last && !ret; i++) {
+        ret = critbit_range_len(map->shards[i], lo, lolen, hi, hilen, cb, data);
+    }
+    return ret;
+}
+
+int critbit_sharded_range(critbit_sharded *map, const char *lo, const char *hi,
+        critbit_callback cb, void *data) {
+    return critbit_sharded_range_len(map, lo, lo ? strlen(lo) : 0,
+            hi, hi ? strlen(hi) : 0, cb, data);
+}
+
+int critbit_sharded_iter_prefix(critbit_sharded *map, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data) {
+    // a non-empty prefix fixes the first byte, and with it the shard
+    if(prefix_len)
+        return critbit_iter_prefix(shard_of(map, prefix, prefix_len),
+                prefix, prefix_len, cb, data);
+
+    int i, ret = 0;
+    for(i = 0; i < map->nshards && !ret; i++) {
+        ret = critbit_iter_prefix(map->shards[i], prefix, 0, cb, data);
+    }
+    return ret;
+}
+
+void critbit_sharded_stats(critbit_sharded *map, critbit_statistics *out) {
+    memset(out, 0, sizeof(*out));
+
+    int i, j;
+    for(i = 0; i < map->nshards; i++) {
+        critbit_statistics shard;
+        critbit_stats(map->shards[i], &shard);
+        out->keys += shard.keys;
+        out->nodes += shard.nodes;
+        out->leaf_bytes += shard.leaf_bytes;
+        out->bytes += shard.bytes;
+        out->reserved_bytes += shard.reserved_bytes;
+        for(j = 0; j < CRITBIT_STATS_DEPTHS; j++) {
+            out->depths[j] += shard.depths[j];
+        }
+    }
+}
+
+void critbit_sharded_clear(critbit_sharded *map) {
+    int i;
+    for(i = 0; i < map->nshards; i++) {
+        critbit_clear(map->shards[i]);
+    }
+}
+
+void critbit_sharded_free(critbit_sharded *map) {
+    int i;
+    for(i = 0; i < map->nshards; i++) {
+        critbit_free(map->shards[i]);
+    }
+    free(map);
 }
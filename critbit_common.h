@@ -9,53 +9,553 @@ typedef struct critbit_node critbit_node;
 struct critbit_node {
     void *child[2];
     int byte;
-    uint8_t otherbits;
+    uint16_t otherbits;
+#ifdef CRITBIT_COUNTED
+    // keys below the node, for rank and select
+    size_t count;
+#endif
+};
+
+// Leaves carry the key length, so keys are arbitrary byte strings. The key is
+// still followed by a NUL for the convenience of string users.
+typedef struct critbit_leaf critbit_leaf;
+struct critbit_leaf {
+    void *value;
+    uint32_t len;
+    uint8_t key[];
 };
 
 critbit_root *critbit_new(void);
 int critbit_insert(critbit_root *root, const char *key, const void* value);
+int critbit_insert_len(critbit_root *root, const void *key, size_t len, const void* value);
 int critbit_get(critbit_root *root, const char *key, void **out);
+int critbit_get_len(critbit_root *root, const void *key, size_t len, void **out);
 int critbit_contains(critbit_root *root, const char *key);
+
+// Inserts key, or gives an existing key the new value. returns 0 if the key
+// was new, 1 if it was there, its previous value is then stored in old.
+// -1 if out of memory
+int critbit_upsert(critbit_root *root, const char *key, const void *value, void **old);
+int critbit_upsert_len(critbit_root *root, const void *key, size_t len,
+        const void *value, void **old);
+
+// Makes the value for a key critbit_get_or_insert didn't find. If a
+// concurrent insert of the same key wins, the value made is dropped.
+typedef void *(*critbit_make_value)(void *data, const char *key, uint32_t key_len);
+
+// Stores the value of key in out, inserting the one made by make if the
+// key is missing. returns 0 if it was inserted, 1 if it was there, -1 if
+// out of memory
+int critbit_get_or_insert(critbit_root *root, const char *key,
+        critbit_make_value make, void *data, void **out);
+int critbit_get_or_insert_len(critbit_root *root, const void *key, size_t len,
+        critbit_make_value make, void *data, void **out);
+
+// Atomic updates of the value of an existing key. They don't take the
+// writer lock, so updates of different keys run in parallel. return 0 on
+// success, 1 if the key is missing. critbit_cas_value also fails if the
+// value isn't expected. old, if not NULL, gets the value before the update
+int critbit_cas_value(critbit_root *root, const char *key, void *expected, void *desired);
+int critbit_cas_value_len(critbit_root *root, const void *key, size_t len,
+        void *expected, void *desired);
+// adds delta to the value taken as an integer
+int critbit_fetch_add(critbit_root *root, const char *key, intptr_t delta, void **old);
+int critbit_fetch_add_len(critbit_root *root, const void *key, size_t len,
+        intptr_t delta, void **old);
+int critbit_exchange_value(critbit_root *root, const char *key, void *value, void **old);
+int critbit_exchange_value_len(critbit_root *root, const void *key, size_t len,
+        void *value, void **old);
+// looks up n keys at once, out[i] is NULL for a missing key. returns the
+// number of keys found
+int critbit_get_batch(critbit_root *root, const void *const *keys, const size_t *lens,
+        void **out, size_t n);
+// Finds the longest key that is a prefix of key, in a single descent.
+// returns 0 and its length and value if there's one, 1 if there's none,
+// -1 if out of memory
+int critbit_longest_prefix(critbit_root *root, const void *key, size_t len,
+        size_t *matched_len, void **value);
 int critbit_delete(critbit_root *root, const char *key);
+int critbit_delete_len(critbit_root *root, const void *key, size_t len);
+// Drops every key, the tree stays usable. Nothing else may use it
+// meanwhile. critbit_clear_parallel frees the nodes on nthreads threads
 void critbit_clear(critbit_root *root);
+void critbit_clear_parallel(critbit_root *root, int nthreads);
+// clears the tree and frees the root
+void critbit_free(critbit_root *root);
+
+// Counters kept up to date by every change, reading them costs nothing.
+// Depths are those the keys had when they were inserted, a later insert
+// above a key pushes it down without it being counted again. The last
+// bucket holds everything deeper.
+typedef struct critbit_statistics {
+    size_t keys;
+    size_t nodes;
+    // allocated leaves, inline keys take none
+    size_t leaf_bytes;
+    // nodes and leaves in the tree
+    size_t bytes;
+    // held by the allocator, including free and not yet reclaimed memory
+    size_t reserved_bytes;
+    size_t depths[CRITBIT_STATS_DEPTHS];
+} critbit_statistics;
+
+void critbit_stats(critbit_root *root, critbit_statistics *out);
+
+// Builds a new tree from n keys at once, far faster than inserting them one
+// by one. Sorted input is built in a single pass over the keys, anything
+// else is sorted on several threads first. Of duplicate keys the first one
+// wins. vals may be NULL. returns NULL if out of memory
+critbit_root *critbit_build(const char *const *keys, void *const *vals, size_t n);
+critbit_root *critbit_build_len(const void *const *keys, const size_t *lens,
+        void *const *vals, size_t n);
+
+// Deleted nodes and leaves are freed in batches once no reader can see
+// them. By default the deleting thread collects a batch when enough are
+// pending, critbit_start_reclaimer hands that to a background thread.
+void critbit_set_reclaim_batch(critbit_root *root, size_t batch);
+int critbit_start_reclaimer(critbit_root *root);
+
+// Same contract as art_callback: return non-zero to stop the iteration.
+// Callbacks run under reader protection and must not modify the tree.
+typedef int(*critbit_callback)(void *data, const char *key, uint32_t key_len, void *value);
+
+typedef struct critbit_step {
+    critbit_node *node;
+    int dir;
+} critbit_step;
+
+// Ordered cursor. It keeps the path to the current leaf and a copy of its
+// key, so it survives concurrent writes: if the tree changed since the last
+// move, the cursor re-seeks from the saved key.
+typedef struct critbit_cursor {
+    critbit_root *root;
+    int state;
+    unsigned long version;
+
+    // the tree walked, the root's head or a snapshot's
+    void **head;
+    critbit_step *path;
+    int depth, cap;
+
+    // only valid under reader protection, key below is the stable copy
+    void *leaf;
+    uint8_t *key;
+    size_t len, keycap;
+    void *value;
+} critbit_cursor;
+
+// positions at the first key >= key. the cursor is past the end if there's none
+critbit_cursor *critbit_seek(critbit_root *root, const char *key);
+critbit_cursor *critbit_seek_len(critbit_root *root, const void *key, size_t len);
+// move to the next/previous key. return 0 on success, 1 if there's none
+int critbit_next(critbit_cursor *cur);
+int critbit_prev(critbit_cursor *cur);
+// current key and value, NULL if the cursor isn't on a key
+const char *critbit_cursor_key(critbit_cursor *cur, size_t *len);
+void *critbit_cursor_value(critbit_cursor *cur);
+void critbit_cursor_free(critbit_cursor *cur);
+
+// calls cb for every key in [lo, hi) in order. NULL bounds are unbounded
+int critbit_range(critbit_root *root, const char *lo, const char *hi,
+        critbit_callback cb, void *data);
+int critbit_range_len(critbit_root *root,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data);
+
+// calls cb for every key starting with prefix, in order. returns 0 on
+// success, or the return of the callback
+int critbit_iter_prefix(critbit_root *root, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data);
+
+// Single key neighbour queries, O(depth) under the same reader protection
+// as critbit_get. The key found is handed to cb with its value, like in
+// critbit_range, and the return of cb is ignored. return 0 if there's
+// such a key, 1 if there's none
+int critbit_first(critbit_root *root, critbit_callback cb, void *data);
+int critbit_last(critbit_root *root, critbit_callback cb, void *data);
+// the first key >= key
+int critbit_lower_bound(critbit_root *root, const char *key,
+        critbit_callback cb, void *data);
+int critbit_lower_bound_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data);
+// the first key > key, its successor
+int critbit_upper_bound(critbit_root *root, const char *key,
+        critbit_callback cb, void *data);
+int critbit_upper_bound_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data);
+// the last key <= key
+int critbit_floor(critbit_root *root, const char *key,
+        critbit_callback cb, void *data);
+int critbit_floor_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data);
+// the first key >= key, same as critbit_lower_bound
+int critbit_ceiling(critbit_root *root, const char *key,
+        critbit_callback cb, void *data);
+int critbit_ceiling_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data);
+// the last key < key
+int critbit_predecessor(critbit_root *root, const char *key,
+        critbit_callback cb, void *data);
+int critbit_predecessor_len(critbit_root *root, const void *key, size_t len,
+        critbit_callback cb, void *data);
+
+// Set operations, walking both trees at once rather than looking up every
+// key of one in the other. Subtrees whose keys are apart from everything in
+// the other tree are taken or skipped whole. A key in both trees keeps its
+// value from a. Like critbit_range, they run under reader protection and
+// may or may not see changes made meanwhile.
+// return a new tree, NULL if out of memory
+critbit_root *critbit_union(critbit_root *a, critbit_root *b);
+critbit_root *critbit_intersect(critbit_root *a, critbit_root *b);
+// the keys of a that aren't in b
+critbit_root *critbit_difference(critbit_root *a, critbit_root *b);
+// call cb for every key of the result in order instead. return 0, or the
+// return of the callback that stopped the walk
+int critbit_union_iter(critbit_root *a, critbit_root *b, critbit_callback cb, void *data);
+int critbit_intersect_iter(critbit_root *a, critbit_root *b, critbit_callback cb, void *data);
+int critbit_difference_iter(critbit_root *a, critbit_root *b, critbit_callback cb, void *data);
+
+#ifdef CRITBIT_COUNTED
+// Order statistics, built with CRITBIT_COUNTED. Every node keeps the number
+// of keys below it, so these are O(depth) like critbit_get. Writers are
+// serialized by wlock to keep the counts right, readers running alongside
+// them may see counts a key off.
+// the number of keys < key
+size_t critbit_rank(critbit_root *root, const char *key);
+size_t critbit_rank_len(critbit_root *root, const void *key, size_t len);
+// hands the key with rank k, counting from 0, to cb. returns 0 if there's
+// such a key, 1 if k is out of range
+int critbit_select(critbit_root *root, size_t k, critbit_callback cb, void *data);
+// the number of keys in [lo, hi)
+size_t critbit_count_range(critbit_root *root, const char *lo, const char *hi);
+size_t critbit_count_range_len(critbit_root *root,
+        const void *lo, size_t lolen, const void *hi, size_t hilen);
+// hands a key chosen uniformly at random to cb. returns 1 if the tree is empty
+int critbit_random_key(critbit_root *root, critbit_callback cb, void *data);
+#endif
+
+// A consistent read-only view of the tree as it was when it was taken.
+// While any snapshot is open, writers take wlock and copy the path to
+// what they change instead of changing it in place. What they replace is
+// freed once every snapshot that can see it is released. Reading a
+// snapshot takes no locks. Snapshots must be released before the tree is
+// cleared, and can't be taken from inside a callback.
+typedef struct critbit_view critbit_view;
+
+critbit_view *critbit_snapshot(critbit_root *root);
+void critbit_snapshot_release(critbit_view *view);
+int critbit_snapshot_get(critbit_view *view, const char *key, void **out);
+int critbit_snapshot_get_len(critbit_view *view, const void *key, size_t len, void **out);
+int critbit_snapshot_range(critbit_view *view, const char *lo, const char *hi,
+        critbit_callback cb, void *data);
+int critbit_snapshot_range_len(critbit_view *view,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data);
+int critbit_snapshot_iter_prefix(critbit_view *view, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data);
+
+// A tree saved to a file and used straight from a read-only mapping, so
+// it's ready as soon as it's opened. Values are saved as they are, which
+// is only meaningful if they aren't pointers. The image must be trusted,
+// it isn't checked beyond its header. Writes go to an overlay tree that
+// is consulted first, deletes leave tombstones there.
+typedef struct critbit_image critbit_image;
+
+// writes a consistent image of the tree, replacing path only once it's
+// complete. returns 0 on success
+int critbit_save(critbit_root *root, const char *path);
+critbit_image *critbit_open_mmap(const char *path);
+void critbit_image_close(critbit_image *img);
+critbit_root *critbit_image_overlay(critbit_image *img);
+int critbit_image_get(critbit_image *img, const char *key, void **out);
+int critbit_image_get_len(critbit_image *img, const void *key, size_t len, void **out);
+// inserts or updates key. returns 0 on success, 1 if out of memory
+int critbit_image_put(critbit_image *img, const char *key, const void *value);
+int critbit_image_put_len(critbit_image *img, const void *key, size_t len, const void *value);
+int critbit_image_delete(critbit_image *img, const char *key);
+int critbit_image_delete_len(critbit_image *img, const void *key, size_t len);
+int critbit_image_range(critbit_image *img, const char *lo, const char *hi,
+        critbit_callback cb, void *data);
+int critbit_image_range_len(critbit_image *img,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data);
+int critbit_image_iter_prefix(critbit_image *img, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data);
+
+// A read-only copy of the tree without pointers, for large key sets
+// that are built once and only queried: the shape takes about two bits
+// per key and the critical bits and key offsets a few bytes more. Lookups
+// pay for that with rank computations on the way down. Values are kept
+// in as few bits as the largest one needs. Nothing is locked, the copy
+// can be shared by any number of threads.
+typedef struct critbit_frozen critbit_frozen;
+
+typedef struct critbit_frozen_statistics {
+    size_t keys;
+    // shape, critical bits and key offsets
+    size_t structure_bytes;
+    size_t key_bytes;
+    size_t value_bytes;
+} critbit_frozen_statistics;
+
+// returns NULL if out of memory
+critbit_frozen *critbit_freeze(critbit_root *root);
+void critbit_frozen_free(critbit_frozen *f);
+void critbit_frozen_stats(critbit_frozen *f, critbit_frozen_statistics *out);
+int critbit_frozen_get(critbit_frozen *f, const char *key, void **out);
+int critbit_frozen_get_len(critbit_frozen *f, const void *key, size_t len, void **out);
+int critbit_frozen_range(critbit_frozen *f, const char *lo, const char *hi,
+        critbit_callback cb, void *data);
+int critbit_frozen_range_len(critbit_frozen *f,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data);
+int critbit_frozen_iter_prefix(critbit_frozen *f, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data);
+
+// Trees over fixed-width integer keys, in numeric order. Nothing is
+// formatted or allocated per key: nodes test a single bit and leaves hold
+// the key and value. Readers take no locks, writers are serialized.
+// insert returns 0 if the key was new, 1 if it was there, -1 if out of
+// memory. range calls cb for every key in [lo, hi]
+#define CRITBIT_INT_DECLARE(name, type) \
+    typedef struct critbit_##name critbit_##name; \
+    typedef int (*critbit_##name##_callback)(void *data, type key, void *value); \
+    critbit_##name *critbit_##name##_new(void); \
+    void critbit_##name##_free(critbit_##name *t); \
+    size_t critbit_##name##_count(critbit_##name *t); \
+    int critbit_##name##_insert(critbit_##name *t, type key, const void *value); \
+    int critbit_##name##_get(critbit_##name *t, type key, void **out); \
+    int critbit_##name##_delete(critbit_##name *t, type key); \
+    int critbit_##name##_range(critbit_##name *t, type lo, type hi, \
+            critbit_##name##_callback cb, void *data);
+
+CRITBIT_INT_DECLARE(u32, uint32_t)
+CRITBIT_INT_DECLARE(u64, uint64_t)
+CRITBIT_INT_DECLARE(u128, unsigned __int128)
+
+// N independent trees, each with its own writer lock and reclamation,
+// partitioned by leading key bits so that shard order is key order. The
+// shard count is rounded up to a power of two, at most 256.
+typedef struct critbit_sharded critbit_sharded;
+
+critbit_sharded *critbit_sharded_new(int nshards);
+int critbit_sharded_count(critbit_sharded *map);
+critbit_root *critbit_sharded_shard(critbit_sharded *map, int i);
+int critbit_sharded_insert(critbit_sharded *map, const char *key, const void *value);
+int critbit_sharded_insert_len(critbit_sharded *map, const void *key, size_t len, const void *value);
+int critbit_sharded_get(critbit_sharded *map, const char *key, void **out);
+int critbit_sharded_get_len(critbit_sharded *map, const void *key, size_t len, void **out);
+int critbit_sharded_delete(critbit_sharded *map, const char *key);
+int critbit_sharded_delete_len(critbit_sharded *map, const void *key, size_t len);
+int critbit_sharded_range(critbit_sharded *map, const char *lo, const char *hi,
+        critbit_callback cb, void *data);
+int critbit_sharded_range_len(critbit_sharded *map,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        critbit_callback cb, void *data);
+int critbit_sharded_iter_prefix(critbit_sharded *map, const char *prefix, int prefix_len,
+        critbit_callback cb, void *data);
+void critbit_sharded_clear(critbit_sharded *map);
+void critbit_sharded_free(critbit_sharded *map);
+// sums the counters of every shard
+void critbit_sharded_stats(critbit_sharded *map, critbit_statistics *out);
+
+// A delete freezes both child slots of the node it's about to unlink by
+// setting MARK_BIT, so that concurrent inserts can't CAS into them. Readers
+// just look through the mark.
+#define MARK_BIT 4
+#define IS_MARKED(ptr) (((size_t)ptr) & MARK_BIT)
+#define MARK(ptr) ((void *)((size_t)(ptr) | MARK_BIT))
+#define UNMARK(ptr) ((void *)((size_t)(ptr) & ~MARK_BIT))
 
 #define IS_INTERNAL(ptr) (((size_t)ptr) & 1)
-#define TO_NODE(ptr) ((void *)((size_t)(ptr) & ~1))
+#define TO_NODE(ptr) ((void *)((size_t)(ptr) & ~(1 | MARK_BIT)))
 #define FROM_NODE(node) (void *)((size_t)node + 1)
+#define CHILD(node, dir) UNMARK((node)->child[dir])
 
-#define alloc_aligned malloc
+// A key of up to INLINE_MAX bytes is stored in the child word itself if
+// its value fits next to it, and has no leaf. The low byte holds the tags
+// and the key length, the key bytes follow and the value takes the rest.
+#define INLINE_BIT 2
+#define INLINE_MAX (sizeof(void *) - 1)
+#define IS_INLINE(ptr) (((size_t)ptr) & INLINE_BIT)
+#define INLINE_LEN(ptr) ((((size_t)ptr) >> 3) & 7)
 
+#ifdef CRITBIT_MALLOC
+#define alloc_node(root) malloc(sizeof(critbit_node))
 #define free_node(root, node) free(node)
-#define alloc_node(root) alloc_aligned(sizeof(critbit_node))
+#define alloc_bytes(root, size) malloc(size)
+#define free_bytes(root, p, size) free(p)
+#else
+#define alloc_node(root) slab_alloc(&(root)->nodes)
+#define free_node(root, node) slab_free(&(root)->nodes, node)
+#define alloc_bytes(root, size) slab_arena_alloc(&(root)->leaves, size)
+#define free_bytes(root, p, size) slab_arena_free(&(root)->leaves, p, size)
+#endif
+
+#define LEAF_SIZE(len) (sizeof(critbit_leaf) + (len) + 1)
 
-static void* alloc_string(const char *key, int len, const void *value) {
-    uint8_t *p = alloc_aligned(len + sizeof(value) + 1);
-    if(!p)
+static critbit_leaf *alloc_leaf(critbit_root *root,
+        const uint8_t *key, size_t len, const void *value) {
+    critbit_leaf *leaf = alloc_bytes(root, LEAF_SIZE(len));
+    if(!leaf)
         return NULL;
 
-    memcpy(p, &value, sizeof(value));
-    p += sizeof(value);
-    memcpy(p, key, len + 1);
+    leaf->value = (void *)value;
+    leaf->len = len;
+    memcpy(leaf->key, key, len);
+    leaf->key[len] = '\0';
 
-    return p;
+    return leaf;
+}
+
+static inline int inline_fits(size_t len, const void *value) {
+    return len <= INLINE_MAX && ((size_t)value >> (INLINE_MAX - len) * 8) == 0;
+}
+
+static inline void *inline_leaf(const uint8_t *key, size_t len, const void *value) {
+    size_t word = (size_t)value;
+    size_t i;
+    for(i = len; i-- > 0;) {
+        word = word << 8 | key[i];
+    }
+    return (void *)(word << 8 | len << 3 | INLINE_BIT);
+}
+
+// an inline leaf if the key is short enough, an allocated one otherwise
+static void *new_leaf(critbit_root *root,
+        const uint8_t *key, size_t len, const void *value) {
+    if(inline_fits(len, value))
+        return inline_leaf(key, len, value);
+    return alloc_leaf(root, key, len, value);
+}
+
+static void free_leaf(critbit_root *root, void *p) {
+    if(IS_INLINE(p))
+        return;
+    critbit_leaf *leaf = p;
+    free_bytes(root, leaf, LEAF_SIZE(leaf->len));
+}
+
+static inline void *leaf_value(const void *p) {
+    if(IS_INLINE(p))
+        return (void *)(((size_t)p >> 8) >> INLINE_LEN(p) * 8);
+    return ((const critbit_leaf *)p)->value;
+}
+
+// A leaf as readers see it. Inline keys are unpacked into buf, so key only
+// lives as long as the view does
+typedef struct leaf_view {
+    const uint8_t *key;
+    uint32_t len;
+    void *value;
+    uint8_t buf[INLINE_MAX + 1];
+} leaf_view;
+
+static inline void leaf_load(leaf_view *view, const void *p) {
+    if(!IS_INLINE(p)) {
+        const critbit_leaf *leaf = UNMARK(p);
+        view->key = leaf->key;
+        view->len = leaf->len;
+        view->value = leaf->value;
+        return;
+    }
+
+    size_t word = (size_t)p >> 8;
+    uint32_t i, len = INLINE_LEN(p);
+    for(i = 0; i < len; i++) {
+        view->buf[i] = word;
+        word >>= 8;
+    }
+    view->buf[len] = '\0';
+    view->key = view->buf;
+    view->len = len;
+    view->value = (void *)word;
+}
+
+// memcmp order, a key sorts before its extensions
+static inline int key_compare(const uint8_t *a, size_t alen,
+        const uint8_t *b, size_t blen) {
+    int ret = memcmp(a, b, alen < blen ? alen : blen);
+    if(ret)
+        return ret;
+    return (alen > blen) - (alen < blen);
+}
+
+static inline int leaf_matches(const void *p,
+        const uint8_t *bytes, const size_t bytelen) {
+    if(IS_INLINE(p)) {
+        // compare tags, length and key in one go, ignoring the value
+        if(bytelen > INLINE_MAX)
+            return 0;
+        size_t mask = ~(size_t)0 >> (INLINE_MAX - bytelen) * 8;
+        return ((size_t)p & mask & ~(size_t)MARK_BIT) == (size_t)inline_leaf(bytes, bytelen, NULL);
+    }
+    const critbit_leaf *leaf = p;
+    return leaf->len == bytelen && memcmp(leaf->key, bytes, bytelen) == 0;
 }
 
-static void free_string(uint8_t *key) {
-    free(key - sizeof(void *));
+// Keys are compared as strings of 9-bit symbols: a byte inside the key reads
+// as 0x100 | byte and anything past its end reads as 0. Shorter keys thus
+// sort before their extensions and embedded NULs are fine. otherbits is the
+// complement of the critical bit within the symbol.
+static inline int key_direction(uint32_t byte, uint32_t otherbits,
+        const uint8_t *bytes, const size_t bytelen) {
+    uint32_t c = 0;
+    if(byte < bytelen)
+        c = 0x100 | bytes[byte];
+    return (1 + (otherbits | c)) >> 9;
 }
 
-static int get_direction(critbit_node *node,
+static inline int get_direction(critbit_node *node,
         const uint8_t *bytes, const size_t bytelen) {
-    if(node->byte < bytelen)
-        return (1 + (node->otherbits | bytes[node->byte])) >> 8;
+    return key_direction(node->byte, node->otherbits, bytes, bytelen);
+}
+
+// finds the first bit in which two keys differ. returns 1 if they're equal
+static int key_critbit(const uint8_t *a, size_t alen,
+        const uint8_t *b, size_t blen,
+        uint32_t *outbyte, uint32_t *outotherbits) {
+    size_t minlen = alen < blen ? alen : blen;
+    uint32_t newbyte, diff;
+    for(newbyte = 0; newbyte < minlen; ++newbyte) {
+        if(a[newbyte] != b[newbyte]) {
+            diff = a[newbyte] ^ b[newbyte];
+            goto found;
+        }
+    }
+    if(alen == blen)
+        return 1;
+    // one key ends here, they differ in the presence bit
+    diff = 0x100;
+
+found:
+    while(diff & (diff - 1)) {
+        diff &= diff - 1;
+    }
+    *outbyte = newbyte;
+    *outotherbits = diff ^ 0x1FF;
     return 0;
 }
 
+static int find_critbit(const void *p,
+        const uint8_t *bytes, const size_t bytelen,
+        uint32_t *outbyte, uint32_t *outotherbits) {
+    leaf_view leaf;
+    leaf_load(&leaf, p);
+    return key_critbit(leaf.key, leaf.len, bytes, bytelen, outbyte, outotherbits);
+}
+
+// whether a node testing the first bit comes above one testing the second
+static inline int crit_before(uint32_t byte, uint32_t otherbits,
+        uint32_t byte2, uint32_t otherbits2) {
+    return byte < byte2 || (byte == byte2 && otherbits < otherbits2);
+}
+
 static void *find_nearest(void *p, const uint8_t *bytes, const size_t bytelen) {
     while(IS_INTERNAL(p)) {
         critbit_node *node = TO_NODE(p);
         int dir = get_direction(node, bytes, bytelen);
-        p = node->child[dir];
+        p = CHILD(node, dir);
     }
     return p;
 }
@@ -67,8 +567,62 @@ int critbit_contains(critbit_root *root, const char *key) {
 
 #include "helper.h"
 
+static void init_options(critbit_root *root) {
+    const char *env = getenv("RECLAIM_BATCH");
+    if(env && atoi(env) > 0)
+        critbit_set_reclaim_batch(root, atoi(env));
+    env = getenv("RECLAIMER");
+    if(env && atoi(env))
+        critbit_start_reclaimer(root);
+}
+
+const int concurrent_writes = 1;
+
+#ifdef CRITBIT_SHARDED
+#define DEFAULT_SHARDS 16
+
+void* init(void) {
+    const char *env = getenv("SHARDS");
+    critbit_sharded *map = critbit_sharded_new(env && atoi(env) > 0 ? atoi(env) : DEFAULT_SHARDS);
+
+    int i;
+    for(i = 0; i < critbit_sharded_count(map); i++) {
+        init_options(critbit_sharded_shard(map, i));
+    }
+    return map;
+}
+
+int add(void *obj, const char *key, void *val) {
+    critbit_sharded *map = obj;
+    return critbit_sharded_insert(map, key, val);
+}
+
+void* find(void *obj, const char *key) {
+    critbit_sharded *map = obj;
+    void *out = NULL;
+    critbit_sharded_get(map, key, &out);
+    return out;
+}
+
+int del(void *obj, const char *key) {
+    critbit_sharded *map = obj;
+    return critbit_sharded_delete(map, key);
+}
+
+void clear(void *obj) {
+    critbit_sharded *map = obj;
+    critbit_sharded_free(map);
+}
+
+int iter_prefix(void *obj, const char *prefix, int prefix_len,
+        iter_callback cb, void *data) {
+    critbit_sharded *map = obj;
+    return critbit_sharded_iter_prefix(map, prefix, prefix_len, cb, data);
+}
+#else
 void* init(void) {
     critbit_root *root = critbit_new();
+    init_options(root);
     return root;
 }
 
@@ -91,37 +645,176 @@ int del(void *obj, const char *key) {
 
 void clear(void *obj) {
     critbit_root *root = obj;
-    critbit_clear(root);
+    critbit_free(root);
 
 }
 
-void fill_depth(void *ptr, int depth, int *out, int outsize) {
-    if(!IS_INTERNAL(ptr)) {
-        if(depth > outsize) {
-            printf("overflow: %d\n", depth);
-            return;
-        }
-        ++out[depth];
-        return;
+int iter_prefix(void *obj, const char *prefix, int prefix_len,
+        iter_callback cb, void *data) {
+    critbit_root *root = obj;
+    return critbit_iter_prefix(root, prefix, prefix_len, cb, data);
+}
+
+void *build(const char *const *keys, void *const *vals, int n) {
+    return critbit_build(keys, vals, n);
+}
+
+static int lower_bound_value(void *data, const char *key, uint32_t key_len, void *value) {
+    *(void **)data = value;
+    return 0;
+}
+
+void *lower_bound(void *obj, const char *key) {
+    critbit_root *root = obj;
+    void *out = NULL;
+    critbit_lower_bound(root, key, lower_bound_value, &out);
+    return out;
+}
+
+#ifdef CRITBIT_COUNTED
+size_t key_rank(void *obj, const char *key) {
+    critbit_root *root = obj;
+    return critbit_rank(root, key);
+}
+
+void *key_select(void *obj, size_t k) {
+    critbit_root *root = obj;
+    void *out = NULL;
+    critbit_select(root, k, lower_bound_value, &out);
+    return out;
+}
+#endif
+
+void *set_union(void *a, void *b) {
+    return critbit_union(a, b);
+}
+
+void *set_intersect(void *a, void *b) {
+    return critbit_intersect(a, b);
+}
+
+void *set_difference(void *a, void *b) {
+    return critbit_difference(a, b);
+}
+
+int longest_prefix(void *obj, const char *key, void **val) {
+    critbit_root *root = obj;
+    size_t len;
+    if(critbit_longest_prefix(root, key, strlen(key), &len, val))
+        return -1;
+    return len;
+}
+
+#ifndef CRITBIT_MALLOC
+size_t memory_usage(void *obj) {
+    critbit_root *root = obj;
+    return slab_bytes(&root->nodes) + slab_arena_bytes(&root->leaves);
+}
+#endif
+
+int find_batch(void *obj, const char *const *keys, void **out, int n) {
+    critbit_root *root = obj;
+    size_t lens[n];
+    int i;
+    for(i = 0; i < n; i++) {
+        lens[i] = strlen(keys[i]);
     }
+    return critbit_get_batch(root, (const void *const *)keys, lens, out, n);
+}
+#endif
+
+// The `set` IDs as integers, in a tree of ID_BITS bit keys
+typedef struct critbit_ids {
+    int bits;
+    void *tree;
+} critbit_ids;
+
+void *init_ids(void) {
+    critbit_ids *ids = malloc(sizeof(critbit_ids));
+    const char *env = getenv("ID_BITS");
+    ids->bits = env ? atoi(env) : 64;
+    switch(ids->bits) {
+    case 32:
+        ids->tree = critbit_u32_new();
+        break;
+    case 128:
+        ids->tree = critbit_u128_new();
+        break;
+    default:
+        ids->bits = 64;
+        ids->tree = critbit_u64_new();
+    }
+    return ids;
+}
+
+int add_id(void *obj, uint64_t id, void *val) {
+    critbit_ids *ids = obj;
+    switch(ids->bits) {
+    case 32:
+        return critbit_u32_insert(ids->tree, id, val);
+    case 128:
+        return critbit_u128_insert(ids->tree, id, val);
+    }
+    return critbit_u64_insert(ids->tree, id, val);
+}
+
+void *find_id(void *obj, uint64_t id) {
+    critbit_ids *ids = obj;
+    void *out = NULL;
+    switch(ids->bits) {
+    case 32:
+        critbit_u32_get(ids->tree, id, &out);
+        break;
+    case 128:
+        critbit_u128_get(ids->tree, id, &out);
+        break;
+    default:
+        critbit_u64_get(ids->tree, id, &out);
+    }
+    return out;
+}
 
-    critbit_node *node = TO_NODE(ptr);
-    fill_depth(node->child[0], depth+1, out, outsize);
-    fill_depth(node->child[1], depth+1, out, outsize);
+int del_id(void *obj, uint64_t id) {
+    critbit_ids *ids = obj;
+    switch(ids->bits) {
+    case 32:
+        return critbit_u32_delete(ids->tree, id);
+    case 128:
+        return critbit_u128_delete(ids->tree, id);
+    }
+    return critbit_u64_delete(ids->tree, id);
+}
+
+void clear_ids(void *obj) {
+    critbit_ids *ids = obj;
+    switch(ids->bits) {
+    case 32:
+        critbit_u32_free(ids->tree);
+        break;
+    case 128:
+        critbit_u128_free(ids->tree);
+        break;
+    default:
+        critbit_u64_free(ids->tree);
+    }
+    free(ids);
 }
 
-#define DEPTH_SIZE 100
 void info(void *obj) {
-    critbit_root *root = obj;
-    int depth_dist[DEPTH_SIZE];
-    memset(depth_dist, 0, sizeof(depth_dist));
-    fill_depth(root->head, 0, depth_dist, DEPTH_SIZE);
+    critbit_statistics stats;
+#ifdef CRITBIT_SHARDED
+    critbit_sharded_stats(obj, &stats);
+#else
+    critbit_stats(obj, &stats);
+#endif
 
+    printf("keys\t%zu\nnodes\t%zu\nbytes\t%zu\nreserved\t%zu\n",
+            stats.keys, stats.nodes, stats.bytes, stats.reserved_bytes);
     int i;
-    for(i = 0; i < DEPTH_SIZE; i++) {
-        if(depth_dist[i] == 0)
+    for(i = 0; i < CRITBIT_STATS_DEPTHS; i++) {
+        if(stats.depths[i] == 0)
             continue;
-        printf("%d:\t%d\n", i, depth_dist[i]);
+        printf("%d:\t%zu\n", i, stats.depths[i]);
     }
     printf("\n");
 }
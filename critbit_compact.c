@@ -0,0 +1,420 @@
+// Critical-bit tree with a compact layout. Children are 32-bit references
+// into chunked arenas instead of pointers, which makes a node 12 bytes
+// instead of 24. The tree is otherwise the one in critbit.c: same key
+// order, same 9-bit symbol comparison.
+
+// for pthread_rwlockattr_setkind_np
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// A reference keeps the internal-node tag in bit 0, like the pointers of
+// critbit.c. Nodes are numbered, leaves are addressed in 8-byte units of
+// the leaf arena. Both start at 1, so 0 is the empty reference.
+#define IS_INTERNAL(ref) ((ref) & 1)
+#define REF_INDEX(ref) ((ref) >> 1)
+#define NODE_REF(index) (((index) << 1) | 1)
+#define LEAF_REF(index) ((index) << 1)
+
+typedef struct compact_node {
+    uint32_t child[2];
+    // byte << 9 | otherbits, nodes higher up have smaller values
+    uint32_t crit;
+} compact_node;
+
+typedef struct compact_leaf {
+    void *value;
+    uint32_t len;
+    uint8_t key[];
+} compact_leaf;
+
+#define CRIT_BYTE(crit) ((crit) >> 9)
+#define CRIT_OTHERBITS(crit) ((crit) & 0x1FF)
+
+// Arenas grow a chunk at a time and never move, the chunk table is sized
+// for the whole 31-bit index space up front.
+//
+// The tag leaves 31 bits of index, so this falls short of 4G keys. There
+// are at most 2^31 - 1 nodes, so about 2G keys. Leaf memory is limited to
+// 2^31 units of 8 bytes, which is 16 GiB. A key of 9 to 15 bytes takes a
+// 32-byte leaf, so that's 512M such keys.
+#define NODE_CHUNK_BITS 18
+#define NODE_CHUNKS (1 << (31 - NODE_CHUNK_BITS))
+#define LEAF_UNIT 8
+#define LEAF_CHUNK_BITS 18
+#define LEAF_CHUNKS (1 << (31 - LEAF_CHUNK_BITS))
+// freed leaves up to this many units are recycled, larger ones are only
+// reclaimed by critbit_compact_clear
+#define LEAF_FREE_UNITS 64
+
+#define CHUNK_MASK(bits) ((1u << (bits)) - 1)
+#define LEAF_UNITS(len) ((sizeof(compact_leaf) + (len) + 1 + LEAF_UNIT - 1) / LEAF_UNIT)
+// the largest leaf fills a whole chunk
+#define MAX_KEY_LEN ((LEAF_UNIT << LEAF_CHUNK_BITS) - sizeof(compact_leaf) - 1)
+
+typedef struct critbit_compact {
+    uint32_t head;
+
+    compact_node **nodes;
+    uint32_t node_next, node_free;
+    uint8_t **leaves;
+    uint32_t leaf_next;
+    uint32_t leaf_free[LEAF_FREE_UNITS + 1];
+
+    // a single writer, readers share. writers are preferred, or a steady
+    // stream of readers starves them
+    pthread_rwlock_t lock;
+} critbit_compact;
+
+critbit_compact *critbit_compact_new(void) {
+    critbit_compact *t = calloc(1, sizeof(critbit_compact));
+    if(!t)
+        return NULL;
+
+    t->nodes = calloc(NODE_CHUNKS, sizeof(compact_node *));
+    t->leaves = calloc(LEAF_CHUNKS, sizeof(uint8_t *));
+    if(!t->nodes || !t->leaves) {
+        free(t->nodes);
+        free(t->leaves);
+        free(t);
+        return NULL;
+    }
+    t->node_next = 1;
+    t->leaf_next = 1;
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&t->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return t;
+}
+
+static inline compact_node *get_node(critbit_compact *t, uint32_t ref) {
+    uint32_t i = REF_INDEX(ref);
+    return t->nodes[i >> NODE_CHUNK_BITS] + (i & CHUNK_MASK(NODE_CHUNK_BITS));
+}
+
+static inline compact_leaf *get_leaf(critbit_compact *t, uint32_t ref) {
+    uint32_t i = REF_INDEX(ref);
+    return (compact_leaf *)(t->leaves[i >> LEAF_CHUNK_BITS] +
+            (size_t)(i & CHUNK_MASK(LEAF_CHUNK_BITS)) * LEAF_UNIT);
+}
+
+static uint32_t alloc_node(critbit_compact *t) {
+    uint32_t i = t->node_free;
+    if(i) {
+        t->node_free = get_node(t, NODE_REF(i))->child[0];
+        return NODE_REF(i);
+    }
+
+    i = t->node_next;
+    if(i >> 31)
+        return 0;
+    compact_node **chunk = &t->nodes[i >> NODE_CHUNK_BITS];
+    if(!*chunk) {
+        *chunk = malloc(sizeof(compact_node) << NODE_CHUNK_BITS);
+        if(!*chunk)
+            return 0;
+    }
+    ++t->node_next;
+    return NODE_REF(i);
+}
+
+static void free_node(critbit_compact *t, uint32_t ref) {
+    get_node(t, ref)->child[0] = t->node_free;
+    t->node_free = REF_INDEX(ref);
+}
+
+static uint32_t alloc_leaf(critbit_compact *t,
+        const uint8_t *key, size_t len, const void *value) {
+    uint32_t units = LEAF_UNITS(len);
+    if(units > (1u << LEAF_CHUNK_BITS))
+        return 0;
+
+    uint32_t i = 0;
+    if(units <= LEAF_FREE_UNITS && t->leaf_free[units]) {
+        i = t->leaf_free[units];
+        t->leaf_free[units] = *(uint32_t *)get_leaf(t, LEAF_REF(i));
+    } else {
+        // a leaf never straddles two chunks
+        i = t->leaf_next;
+        uint32_t offset = i & CHUNK_MASK(LEAF_CHUNK_BITS);
+        if(offset + units > (1u << LEAF_CHUNK_BITS))
+            i += (1u << LEAF_CHUNK_BITS) - offset;
+        if((i + units) >> 31)
+            return 0;
+
+        uint8_t **chunk = &t->leaves[i >> LEAF_CHUNK_BITS];
+        if(!*chunk) {
+            *chunk = malloc(LEAF_UNIT << LEAF_CHUNK_BITS);
+            if(!*chunk)
+                return 0;
+        }
+        t->leaf_next = i + units;
+    }
+
+    compact_leaf *leaf = get_leaf(t, LEAF_REF(i));
+    leaf->value = (void *)value;
+    leaf->len = len;
+    memcpy(leaf->key, key, len);
+    leaf->key[len] = '\0';
+    return LEAF_REF(i);
+}
+
+static void free_leaf(critbit_compact *t, uint32_t ref) {
+    compact_leaf *leaf = get_leaf(t, ref);
+    uint32_t units = LEAF_UNITS(leaf->len);
+    if(units > LEAF_FREE_UNITS)
+        return;
+
+    *(uint32_t *)leaf = t->leaf_free[units];
+    t->leaf_free[units] = REF_INDEX(ref);
+}
+
+// see key_direction in critbit_common.h
+static inline int get_direction(const compact_node *node,
+        const uint8_t *bytes, size_t bytelen) {
+    uint32_t byte = CRIT_BYTE(node->crit);
+    uint32_t c = byte < bytelen ? 0x100 | bytes[byte] : 0;
+    return (1 + (CRIT_OTHERBITS(node->crit) | c)) >> 9;
+}
+
+static uint32_t find_nearest(critbit_compact *t, uint32_t ref,
+        const uint8_t *bytes, size_t bytelen) {
+    while(IS_INTERNAL(ref)) {
+        compact_node *node = get_node(t, ref);
+        ref = node->child[get_direction(node, bytes, bytelen)];
+    }
+    return ref;
+}
+
+static inline int leaf_matches(const compact_leaf *leaf,
+        const uint8_t *bytes, size_t bytelen) {
+    return leaf->len == bytelen && memcmp(leaf->key, bytes, bytelen) == 0;
+}
+
+int critbit_compact_get_len(critbit_compact *t, const void *key, size_t len, void **out) {
+    pthread_rwlock_rdlock(&t->lock);
+
+    int ret = 1;
+    if(t->head) {
+        compact_leaf *leaf = get_leaf(t, find_nearest(t, t->head, key, len));
+        if(leaf_matches(leaf, key, len)) {
+            *out = leaf->value;
+            ret = 0;
+        }
+    }
+
+    pthread_rwlock_unlock(&t->lock);
+    return ret;
+}
+
+int critbit_compact_get(critbit_compact *t, const char *key, void **out) {
+    return critbit_compact_get_len(t, key, strlen(key), out);
+}
+
+static int compact_insert(critbit_compact *t,
+        const uint8_t *bytes, size_t len, const void *value) {
+    if(len > MAX_KEY_LEN)
+        return 1;
+
+    if(!t->head) {
+        t->head = alloc_leaf(t, bytes, len, value);
+        return t->head ? 0 : 1;
+    }
+
+    compact_leaf *leaf = get_leaf(t, find_nearest(t, t->head, bytes, len));
+
+    // the first bit in which the key differs from its nearest leaf
+    size_t minlen = leaf->len < len ? leaf->len : len;
+    uint32_t newbyte, diff;
+    for(newbyte = 0; newbyte < minlen; ++newbyte) {
+        if(leaf->key[newbyte] != bytes[newbyte]) {
+            diff = leaf->key[newbyte] ^ bytes[newbyte];
+            goto found;
+        }
+    }
+    if(leaf->len == len)
+        return 1;
+    diff = 0x100;
+
+found:
+    while(diff & (diff - 1)) {
+        diff &= diff - 1;
+    }
+    uint32_t newcrit = newbyte << 9 | (diff ^ 0x1FF);
+    uint32_t c = newbyte < leaf->len ? 0x100 | leaf->key[newbyte] : 0;
+    int newdirection = (1 + ((diff ^ 0x1FF) | c)) >> 9;
+
+    uint32_t noderef = alloc_node(t);
+    if(!noderef)
+        return 1;
+    uint32_t x = alloc_leaf(t, bytes, len, value);
+    if(!x) {
+        free_node(t, noderef);
+        return 1;
+    }
+
+    compact_node *node = get_node(t, noderef);
+    node->crit = newcrit;
+    node->child[1 - newdirection] = x;
+
+    uint32_t *wherep = &t->head;
+    for(;;) {
+        uint32_t p = *wherep;
+        if(!IS_INTERNAL(p))
+            break;
+        compact_node *q = get_node(t, p);
+        if(q->crit > newcrit)
+            break;
+        wherep = q->child + get_direction(q, bytes, len);
+    }
+
+    node->child[newdirection] = *wherep;
+    *wherep = noderef;
+    return 0;
+}
+
+int critbit_compact_insert_len(critbit_compact *t, const void *key, size_t len, const void *value) {
+    pthread_rwlock_wrlock(&t->lock);
+    int ret = compact_insert(t, key, len, value);
+    pthread_rwlock_unlock(&t->lock);
+    return ret;
+}
+
+int critbit_compact_insert(critbit_compact *t, const char *key, const void *value) {
+    return critbit_compact_insert_len(t, key, strlen(key), value);
+}
+
+static int compact_delete(critbit_compact *t, const uint8_t *bytes, size_t len) {
+    if(!t->head)
+        return 1;
+
+    uint32_t *wherep = &t->head, *whereq = NULL;
+    uint32_t p = t->head, q = 0;
+    int dir = 0;
+    while(IS_INTERNAL(p)) {
+        whereq = wherep;
+        q = p;
+        compact_node *node = get_node(t, q);
+        dir = get_direction(node, bytes, len);
+        wherep = node->child + dir;
+        p = *wherep;
+    }
+
+    if(!leaf_matches(get_leaf(t, p), bytes, len))
+        return 1;
+    free_leaf(t, p);
+
+    if(!whereq) {
+        t->head = 0;
+        return 0;
+    }
+
+    *whereq = get_node(t, q)->child[1 - dir];
+    free_node(t, q);
+    return 0;
+}
+
+int critbit_compact_delete_len(critbit_compact *t, const void *key, size_t len) {
+    pthread_rwlock_wrlock(&t->lock);
+    int ret = compact_delete(t, key, len);
+    pthread_rwlock_unlock(&t->lock);
+    return ret;
+}
+
+int critbit_compact_delete(critbit_compact *t, const char *key) {
+    return critbit_compact_delete_len(t, key, strlen(key));
+}
+
+// memory used by the arenas, up to their high water marks. the untouched
+// rest of the last chunk costs no physical memory
+size_t critbit_compact_bytes(critbit_compact *t) {
+    return (size_t)t->node_next * sizeof(compact_node) + (size_t)t->leaf_next * LEAF_UNIT +
+        NODE_CHUNKS * sizeof(compact_node *) + LEAF_CHUNKS * sizeof(uint8_t *);
+}
+
+void critbit_compact_clear(critbit_compact *t) {
+    int i;
+    for(i = 0; i < NODE_CHUNKS; i++) {
+        free(t->nodes[i]);
+    }
+    for(i = 0; i < LEAF_CHUNKS; i++) {
+        free(t->leaves[i]);
+    }
+    free(t->nodes);
+    free(t->leaves);
+    pthread_rwlock_destroy(&t->lock);
+    free(t);
+}
+
+#include "helper.h"
+
+void* init(void) {
+    return critbit_compact_new();
+}
+
+int add(void *obj, const char *key, void *val) {
+    critbit_compact *t = obj;
+    return critbit_compact_insert(t, key, val);
+}
+
+void* find(void *obj, const char *key) {
+    critbit_compact *t = obj;
+    void *out = NULL;
+    critbit_compact_get(t, key, &out);
+    return out;
+}
+
+int del(void *obj, const char *key) {
+    critbit_compact *t = obj;
+    return critbit_compact_delete(t, key);
+}
+
+void clear(void *obj) {
+    critbit_compact *t = obj;
+    critbit_compact_clear(t);
+}
+
+const int concurrent_writes = 1;
+
+size_t memory_usage(void *obj) {
+    critbit_compact *t = obj;
+    return critbit_compact_bytes(t);
+}
+
+void fill_depth(critbit_compact *t, uint32_t ref, int depth, int *out, int outsize) {
+    if(!IS_INTERNAL(ref)) {
+        // leaves below the histogram aren't counted
+        if(depth >= outsize)
+            return;
+        ++out[depth];
+        return;
+    }
+
+    compact_node *node = get_node(t, ref);
+    fill_depth(t, node->child[0], depth+1, out, outsize);
+    fill_depth(t, node->child[1], depth+1, out, outsize);
+}
+
+#define DEPTH_SIZE 100
+void info(void *obj) {
+    critbit_compact *t = obj;
+    int depth_dist[DEPTH_SIZE];
+    memset(depth_dist, 0, sizeof(depth_dist));
+    if(t->head)
+        fill_depth(t, t->head, 0, depth_dist, DEPTH_SIZE);
+
+    int i;
+    for(i = 0; i < DEPTH_SIZE; i++) {
+        if(depth_dist[i] == 0)
+            continue;
+        printf("%d:\t%d\n", i, depth_dist[i]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,974 @@
+// Critical-bit tree with multi-way nodes, after the Height Optimized Trie.
+// A node packs a connected piece of the binary crit-bit tree with up to 32
+// outgoing edges. Its bit tests are stored as partial keys: the node lists
+// the key bits it tests, and every entry keeps the bits that must be set
+// on the way to it. A lookup extracts the tested bits of its key once and
+// takes the last entry whose partial key is contained in them. Keys are in
+// the same order as in critbit.c.
+//
+// Unlike HOT, a node is not a single 64-byte cache line. It is one malloc
+// of variable size: a header, the tested bytes and masks, up to 32 sparse
+// partial keys and up to 32 full 8-byte child pointers, 416 bytes when
+// full. With a million random keys a node averages 292 bytes, so a
+// lookup touches about five cache lines per node rather than one. The
+// height drops as intended, from 20-30 binary levels to 5 nodes. But every
+// insert and delete decodes its node and encodes a new copy of it, which
+// costs more than the height saves: at 100k keys an insert takes about 5
+// us against 1 us in critbit.c, and a delete under readers 2 us against
+// 0.6 us. Fitting a node in 64 bytes would take 32-bit child references
+// into an arena as in critbit_compact.c, and several node sizes.
+
+// for pthread_rwlockattr_setkind_np
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+#define HOT_MAX_ENTRIES 32
+
+// A bit position counts 9-bit symbols, see key_direction in
+// critbit_common.h: pos / 9 is the byte, pos % 9 the bit inside its
+// symbol, 0 being the presence bit. Earlier positions sort higher up.
+#define POS_NONE UINT32_MAX
+
+typedef struct hot_node {
+    uint8_t n;
+    // key bytes holding tested bits
+    uint8_t nbytes;
+    uint16_t pad;
+    // bit tested at the node's binary root, the earliest of all
+    uint32_t rootpos;
+    // followed by uint32_t byte[nbytes], uint16_t mask[nbytes], the 9-bit
+    // masks of tested bits, uint32_t sparse[n] and void *child[n]
+} hot_node;
+
+typedef struct hot_leaf {
+    void *value;
+    uint32_t len;
+    uint8_t key[];
+} hot_leaf;
+
+#define IS_INTERNAL(ptr) (((size_t)ptr) & 1)
+#define TO_NODE(ptr) ((hot_node *)((size_t)(ptr) & ~1))
+#define FROM_NODE(node) (void *)((size_t)node + 1)
+
+typedef struct critbit_hot {
+    void *head;
+    size_t bytes;
+
+    // a single writer, readers share. writers are preferred, or a steady
+    // stream of readers starves them
+    pthread_rwlock_t lock;
+} critbit_hot;
+
+#define ALIGN(off, a) (((off) + (a) - 1) & ~(size_t)((a) - 1))
+
+static inline size_t sparse_offset(int nbytes) {
+    return ALIGN(sizeof(hot_node) + nbytes * (sizeof(uint32_t) + sizeof(uint16_t)), 4);
+}
+
+static inline size_t child_offset(int n, int nbytes) {
+    return ALIGN(sparse_offset(nbytes) + n * sizeof(uint32_t), 8);
+}
+
+static inline size_t node_size(int n, int nbytes) {
+    return child_offset(n, nbytes) + n * sizeof(void *);
+}
+
+static inline uint32_t *node_bytes(const hot_node *node) {
+    return (uint32_t *)(node + 1);
+}
+
+static inline uint16_t *node_masks(const hot_node *node) {
+    return (uint16_t *)(node_bytes(node) + node->nbytes);
+}
+
+static inline uint32_t *node_sparse(const hot_node *node) {
+    return (uint32_t *)((uint8_t *)node + sparse_offset(node->nbytes));
+}
+
+static inline void **node_children(const hot_node *node) {
+    return (void **)((uint8_t *)node + child_offset(node->n, node->nbytes));
+}
+
+static inline int key_bit(const uint8_t *key, size_t len, uint32_t pos) {
+    uint32_t byte = pos / 9;
+    uint32_t s = byte < len ? 0x100 | key[byte] : 0;
+    return (s >> (8 - pos % 9)) & 1;
+}
+
+// first position in which two keys differ, POS_NONE if they're equal
+static uint32_t key_critpos(const uint8_t *a, size_t alen,
+        const uint8_t *b, size_t blen) {
+    size_t minlen = alen < blen ? alen : blen;
+    size_t i;
+    for(i = 0; i < minlen; i++) {
+        if(a[i] != b[i])
+            return i * 9 + 8 - (31 - __builtin_clz(a[i] ^ b[i]));
+    }
+    if(alen == blen)
+        return POS_NONE;
+    // one key ends here, they differ in the presence bit
+    return minlen * 9;
+}
+
+// the tested bits of key, the earliest one highest
+static inline uint32_t dense_key(const hot_node *node, const uint8_t *key, size_t len) {
+    const uint32_t *bytes = node_bytes(node);
+    const uint16_t *masks = node_masks(node);
+    uint32_t dense = 0;
+
+    int i;
+    for(i = 0; i < node->nbytes; i++) {
+        uint32_t byte = bytes[i], mask = masks[i];
+        uint32_t s = byte < len ? 0x100 | key[byte] : 0;
+#ifdef __BMI2__
+        dense = (dense << __builtin_popcount(mask)) | _pext_u32(s, mask);
+#else
+        while(mask) {
+            int bit = 31 - __builtin_clz(mask);
+            dense = (dense << 1) | ((s >> bit) & 1);
+            mask &= ~(1u << bit);
+        }
+#endif
+    }
+    return dense;
+}
+
+// the last entry all of whose bits are set in dense. the entries before it
+// went left somewhere dense went right, the ones after it need a bit dense
+// doesn't have
+static inline int search_node(const hot_node *node, uint32_t dense) {
+    const uint32_t *sparse = node_sparse(node);
+    int n = node->n;
+
+#ifdef __SSE2__
+    // the sparse keys are followed by at least 16 bytes of children, so
+    // reading past the last one is fine
+    __m128i d = _mm_set1_epi32(dense);
+    uint32_t matches = 0;
+    int i;
+    for(i = 0; i < n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(sparse + i));
+        __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(d, s), s);
+        matches |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+    }
+    if(n < 32)
+        matches &= (1u << n) - 1;
+    return 31 - __builtin_clz(matches);
+#else
+    int i;
+    for(i = n - 1; i > 0; i--) {
+        if((dense & sparse[i]) == sparse[i])
+            break;
+    }
+    return i;
+#endif
+}
+
+static inline void *next_child(const hot_node *node, const uint8_t *key, size_t len, int *index) {
+    int i = search_node(node, dense_key(node, key, len));
+    if(index)
+        *index = i;
+    return node_children(node)[i];
+}
+
+// tested positions in ascending order. returns their number
+static int node_positions(const hot_node *node, uint32_t *out) {
+    const uint32_t *bytes = node_bytes(node);
+    const uint16_t *masks = node_masks(node);
+    int nbits = 0;
+
+    int i;
+    for(i = 0; i < node->nbytes; i++) {
+        uint32_t mask = masks[i];
+        while(mask) {
+            int bit = 31 - __builtin_clz(mask);
+            out[nbits++] = bytes[i] * 9 + 8 - bit;
+            mask &= ~(1u << bit);
+        }
+    }
+    return nbits;
+}
+
+// The binary tree inside a node, unpacked for changes. A reference is an
+// inner node if >= 0 and entry -(ref + 1) otherwise.
+typedef struct hot_work {
+    int root;
+    int ninner, nentries;
+    uint32_t pos[HOT_MAX_ENTRIES];
+    int child[HOT_MAX_ENTRIES][2];
+    void *entry[HOT_MAX_ENTRIES + 1];
+} hot_work;
+
+#define ENTRY_REF(e) (-(e) - 1)
+#define REF_ENTRY(ref) (-(ref) - 1)
+
+// entries [a, b] share every bit above their subtree root, which is the
+// earliest bit in which they differ
+static int decode_range(hot_work *w, const uint32_t *sparse, int a, int b,
+        const uint32_t *positions, int nbits) {
+    if(a == b)
+        return ENTRY_REF(a);
+
+    uint32_t any = 0, all = ~0u;
+    int i;
+    for(i = a; i <= b; i++) {
+        any |= sparse[i];
+        all &= sparse[i];
+    }
+    int bit = 31 - __builtin_clz(any ^ all);
+    int m = a;
+    while(!((sparse[m] >> bit) & 1))
+        ++m;
+
+    int inner = w->ninner++;
+    w->pos[inner] = positions[nbits - 1 - bit];
+    w->child[inner][0] = decode_range(w, sparse, a, m - 1, positions, nbits);
+    w->child[inner][1] = decode_range(w, sparse, m, b, positions, nbits);
+    return inner;
+}
+
+static void decode(const hot_node *node, hot_work *w) {
+    uint32_t positions[HOT_MAX_ENTRIES];
+    int nbits = node_positions(node, positions);
+
+    w->ninner = 0;
+    w->nentries = node->n;
+    memcpy(w->entry, node_children(node), node->n * sizeof(void *));
+    w->root = decode_range(w, node_sparse(node), 0, node->n - 1, positions, nbits);
+}
+
+static void collect_positions(const hot_work *w, int ref, uint32_t *out, int *n) {
+    if(ref < 0)
+        return;
+    out[(*n)++] = w->pos[ref];
+    collect_positions(w, w->child[ref][0], out, n);
+    collect_positions(w, w->child[ref][1], out, n);
+}
+
+// tested positions in ascending order, without duplicates. returns their number
+static int work_positions(const hot_work *w, uint32_t *out) {
+    int n = 0;
+    collect_positions(w, w->root, out, &n);
+
+    // insertion sort, a node has few bits
+    int i, j, nbits = 0;
+    for(i = 0; i < n; i++) {
+        uint32_t pos = out[i];
+        for(j = nbits; j > 0 && out[j - 1] > pos; j--) {
+            out[j] = out[j - 1];
+        }
+        if(j > 0 && out[j - 1] == pos) {
+            memmove(out + j, out + j + 1, (nbits - j) * sizeof(uint32_t));
+            continue;
+        }
+        out[j] = pos;
+        ++nbits;
+    }
+    return nbits;
+}
+
+static int position_bit(const uint32_t *positions, int nbits, uint32_t pos) {
+    int lo = 0, hi = nbits - 1;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(positions[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return nbits - 1 - lo;
+}
+
+static void encode_entries(const hot_work *w, int ref, uint32_t path,
+        const uint32_t *positions, int nbits,
+        uint32_t *sparse, void **children, int *n) {
+    if(ref < 0) {
+        sparse[*n] = path;
+        children[*n] = w->entry[REF_ENTRY(ref)];
+        ++*n;
+        return;
+    }
+
+    int bit = position_bit(positions, nbits, w->pos[ref]);
+    encode_entries(w, w->child[ref][0], path, positions, nbits, sparse, children, n);
+    encode_entries(w, w->child[ref][1], path | (1u << bit), positions, nbits, sparse, children, n);
+}
+
+static hot_node *encode(critbit_hot *t, const hot_work *w) {
+    uint32_t positions[HOT_MAX_ENTRIES];
+    int nbits = work_positions(w, positions);
+
+    uint32_t sparse[HOT_MAX_ENTRIES];
+    void *children[HOT_MAX_ENTRIES];
+    int n = 0;
+    encode_entries(w, w->root, 0, positions, nbits, sparse, children, &n);
+
+    int i, nbytes = 0;
+    for(i = 0; i < nbits; i++) {
+        if(!i || positions[i] / 9 != positions[i - 1] / 9)
+            ++nbytes;
+    }
+
+    size_t size = node_size(n, nbytes);
+    hot_node *node = malloc(size);
+    if(!node)
+        return NULL;
+    t->bytes += size;
+
+    node->n = n;
+    node->nbytes = nbytes;
+    node->pad = 0;
+    node->rootpos = positions[0];
+
+    uint32_t *bytes = node_bytes(node);
+    uint16_t *masks = node_masks(node);
+    int g = -1;
+    for(i = 0; i < nbits; i++) {
+        uint32_t byte = positions[i] / 9;
+        if(g < 0 || bytes[g] != byte) {
+            ++g;
+            bytes[g] = byte;
+            masks[g] = 0;
+        }
+        masks[g] |= 1 << (8 - positions[i] % 9);
+    }
+    memcpy(node_sparse(node), sparse, n * sizeof(uint32_t));
+    memcpy(node_children(node), children, n * sizeof(void *));
+    return node;
+}
+
+static void free_node(critbit_hot *t, hot_node *node) {
+    t->bytes -= node_size(node->n, node->nbytes);
+    free(node);
+}
+
+static hot_leaf *alloc_leaf(critbit_hot *t, const uint8_t *key, size_t len, const void *value) {
+    hot_leaf *leaf = malloc(sizeof(hot_leaf) + len + 1);
+    if(!leaf)
+        return NULL;
+    t->bytes += sizeof(hot_leaf) + len + 1;
+
+    leaf->value = (void *)value;
+    leaf->len = len;
+    memcpy(leaf->key, key, len);
+    leaf->key[len] = '\0';
+    return leaf;
+}
+
+static void free_leaf(critbit_hot *t, hot_leaf *leaf) {
+    t->bytes -= sizeof(hot_leaf) + leaf->len + 1;
+    free(leaf);
+}
+
+// puts an inner node testing pos on edge, the entry going in direction dir
+static void work_insert(hot_work *w, int *edge, uint32_t pos, int dir, void *entry) {
+    int e = w->nentries++;
+    w->entry[e] = entry;
+
+    int inner = w->ninner++;
+    w->pos[inner] = pos;
+    w->child[inner][dir] = ENTRY_REF(e);
+    w->child[inner][1 - dir] = *edge;
+    *edge = inner;
+}
+
+// the edge pointing at ref
+static int *work_edge(hot_work *w, int ref) {
+    if(w->root == ref)
+        return &w->root;
+
+    int i;
+    for(i = 0; i < w->ninner; i++) {
+        if(w->child[i][0] == ref)
+            return &w->child[i][0];
+        if(w->child[i][1] == ref)
+            return &w->child[i][1];
+    }
+    return NULL;
+}
+
+static int copy_subtree(const hot_work *w, int ref, hot_work *out) {
+    if(ref < 0) {
+        int e = out->nentries++;
+        out->entry[e] = w->entry[REF_ENTRY(ref)];
+        return ENTRY_REF(e);
+    }
+
+    int inner = out->ninner++;
+    out->pos[inner] = w->pos[ref];
+    out->child[inner][0] = copy_subtree(w, w->child[ref][0], out);
+    out->child[inner][1] = copy_subtree(w, w->child[ref][1], out);
+    return inner;
+}
+
+// packs one side of the root of w, a single entry needs no node
+static void *split_side(critbit_hot *t, const hot_work *w, int dir) {
+    int ref = w->child[w->root][dir];
+    if(ref < 0)
+        return w->entry[REF_ENTRY(ref)];
+
+    hot_work side;
+    side.ninner = side.nentries = 0;
+    side.root = copy_subtree(w, ref, &side);
+    hot_node *node = encode(t, &side);
+    return node ? FROM_NODE(node) : NULL;
+}
+
+critbit_hot *critbit_hot_new(void) {
+    critbit_hot *t = malloc(sizeof(critbit_hot));
+    if(!t)
+        return NULL;
+    t->head = NULL;
+    t->bytes = 0;
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&t->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return t;
+}
+
+static hot_leaf *find_nearest(void *p, const uint8_t *key, size_t len) {
+    while(IS_INTERNAL(p)) {
+        p = next_child(TO_NODE(p), key, len, NULL);
+    }
+    return p;
+}
+
+int critbit_hot_get_len(critbit_hot *t, const void *key, size_t len, void **out) {
+    pthread_rwlock_rdlock(&t->lock);
+
+    int ret = 1;
+    if(t->head) {
+        hot_leaf *leaf = find_nearest(t->head, key, len);
+        if(leaf->len == len && memcmp(leaf->key, key, len) == 0) {
+            *out = leaf->value;
+            ret = 0;
+        }
+    }
+
+    pthread_rwlock_unlock(&t->lock);
+    return ret;
+}
+
+int critbit_hot_get(critbit_hot *t, const char *key, void **out) {
+    return critbit_hot_get_len(t, key, strlen(key), out);
+}
+
+typedef struct hot_path {
+    void ***slots;
+    int depth, cap;
+} hot_path;
+
+static int path_push(hot_path *path, void **slot) {
+    if(path->depth == path->cap) {
+        int cap = path->cap ? path->cap * 2 : 16;
+        void ***slots = realloc(path->slots, cap * sizeof(void **));
+        if(!slots)
+            return 1;
+        path->slots = slots;
+        path->cap = cap;
+    }
+    path->slots[path->depth++] = slot;
+    return 0;
+}
+
+static int hot_insert(critbit_hot *t, const uint8_t *key, size_t len, const void *value) {
+    if(!t->head) {
+        t->head = alloc_leaf(t, key, len, value);
+        return t->head ? 0 : 1;
+    }
+
+    hot_leaf *nearest = find_nearest(t->head, key, len);
+    uint32_t newpos = key_critpos(nearest->key, nearest->len, key, len);
+    if(newpos == POS_NONE)
+        return 1;
+    int newdir = key_bit(key, len, newpos);
+
+    hot_leaf *x = alloc_leaf(t, key, len, value);
+    if(!x)
+        return 1;
+
+    hot_work w;
+    hot_path path = {NULL, 0, 0};
+    void **slot = &t->head;
+    hot_node *old = NULL;
+
+    if(!IS_INTERNAL(t->head)) {
+        w.ninner = 0;
+        w.nentries = 1;
+        w.entry[0] = t->head;
+        w.root = ENTRY_REF(0);
+        work_insert(&w, &w.root, newpos, newdir, x);
+    } else {
+        // find the node owning the edge the new bit goes on. a child whose
+        // root tests a later bit is entered, the new bit goes above it
+        // otherwise
+        for(;;) {
+            old = TO_NODE(*slot);
+            decode(old, &w);
+
+            int *edge = &w.root;
+            while(*edge >= 0 && w.pos[*edge] < newpos) {
+                edge = &w.child[*edge][key_bit(key, len, w.pos[*edge])];
+            }
+
+            if(*edge < 0) {
+                int e = REF_ENTRY(*edge);
+                void *p = w.entry[e];
+                if(IS_INTERNAL(p) && TO_NODE(p)->rootpos < newpos) {
+                    if(path_push(&path, slot)) {
+                        free(path.slots);
+                        free_leaf(t, x);
+                        return 1;
+                    }
+                    slot = node_children(old) + e;
+                    continue;
+                }
+            }
+
+            work_insert(&w, edge, newpos, newdir, x);
+            break;
+        }
+    }
+
+    // a full node splits at its root, which moves up into the parent. the
+    // tree only grows at the top. nothing changes until the last node is
+    // written, so a failure leaves the tree as it was
+    hot_node **replaced = malloc((path.depth + 1) * sizeof(hot_node *));
+    void **made = malloc(2 * (path.depth + 1) * sizeof(void *));
+    int i, nreplaced = 0, nmade = 0;
+    if(!replaced || !made)
+        goto fail;
+
+    for(;;) {
+        if(old)
+            replaced[nreplaced++] = old;
+
+        if(w.ninner < HOT_MAX_ENTRIES) {
+            hot_node *node = encode(t, &w);
+            if(!node)
+                goto fail;
+            *slot = FROM_NODE(node);
+            break;
+        }
+
+        uint32_t pos = w.pos[w.root];
+        int dir;
+        void *side[2];
+        for(dir = 0; dir < 2; dir++) {
+            side[dir] = split_side(t, &w, dir);
+            if(!side[dir])
+                goto fail;
+            if(w.child[w.root][dir] >= 0)
+                made[nmade++] = side[dir];
+        }
+
+        if(!path.depth) {
+            w.ninner = 0;
+            w.nentries = 1;
+            w.entry[0] = side[0];
+            w.root = ENTRY_REF(0);
+            work_insert(&w, &w.root, pos, 1, side[1]);
+            old = NULL;
+            continue;
+        }
+
+        void **parent_slot = path.slots[--path.depth];
+        hot_node *parent = TO_NODE(*parent_slot);
+        int e = slot - node_children(parent);
+        decode(parent, &w);
+        w.entry[e] = side[0];
+        work_insert(&w, work_edge(&w, ENTRY_REF(e)), pos, 1, side[1]);
+        old = parent;
+        slot = parent_slot;
+    }
+
+    for(i = 0; i < nreplaced; i++) {
+        free_node(t, replaced[i]);
+    }
+    free(replaced);
+    free(made);
+    free(path.slots);
+    return 0;
+
+fail:
+    for(i = 0; i < nmade; i++) {
+        free_node(t, TO_NODE(made[i]));
+    }
+    free(replaced);
+    free(made);
+    free(path.slots);
+    free_leaf(t, x);
+    return 1;
+}
+
+int critbit_hot_insert_len(critbit_hot *t, const void *key, size_t len, const void *value) {
+    pthread_rwlock_wrlock(&t->lock);
+    int ret = hot_insert(t, key, len, value);
+    pthread_rwlock_unlock(&t->lock);
+    return ret;
+}
+
+int critbit_hot_insert(critbit_hot *t, const char *key, const void *value) {
+    return critbit_hot_insert_len(t, key, strlen(key), value);
+}
+
+// Nodes left small by deletes aren't merged back, they only cost height.
+// returns 0 if the key was deleted, 1 if it's missing, -1 if out of memory
+// for the node that replaces its own, the key then stays
+static int hot_delete(critbit_hot *t, const uint8_t *key, size_t len) {
+    void *p = t->head;
+    if(!p)
+        return 1;
+
+    // slot ends up pointing at the node holding the leaf
+    void **slot = &t->head;
+    hot_node *node = NULL;
+    int e = 0;
+    while(IS_INTERNAL(p)) {
+        node = TO_NODE(p);
+        p = next_child(node, key, len, &e);
+        if(IS_INTERNAL(p))
+            slot = node_children(node) + e;
+    }
+
+    hot_leaf *leaf = p;
+    if(leaf->len != len || memcmp(leaf->key, key, len) != 0)
+        return 1;
+
+    if(!node) {
+        t->head = NULL;
+        free_leaf(t, leaf);
+        return 0;
+    }
+
+    hot_work w;
+    decode(node, &w);
+
+    // the leaf's binary parent goes, its sibling takes its place
+    int ref = ENTRY_REF(e), i;
+    for(i = 0; i < w.ninner; i++) {
+        if(w.child[i][0] == ref || w.child[i][1] == ref)
+            break;
+    }
+    int sibling = w.child[i][w.child[i][0] == ref];
+    *work_edge(&w, i) = sibling;
+
+    if(w.root < 0) {
+        *slot = w.entry[REF_ENTRY(w.root)];
+    } else {
+        hot_node *replacement = encode(t, &w);
+        if(!replacement)
+            return -1;
+        *slot = FROM_NODE(replacement);
+    }
+
+    free_node(t, node);
+    free_leaf(t, leaf);
+    return 0;
+}
+
+int critbit_hot_delete_len(critbit_hot *t, const void *key, size_t len) {
+    pthread_rwlock_wrlock(&t->lock);
+    int ret = hot_delete(t, key, len);
+    pthread_rwlock_unlock(&t->lock);
+    return ret;
+}
+
+int critbit_hot_delete(critbit_hot *t, const char *key) {
+    return critbit_hot_delete_len(t, key, strlen(key));
+}
+
+// In-order iteration keeps the entry taken in every node on the way down
+typedef struct hot_step {
+    hot_node *node;
+    int index;
+} hot_step;
+
+typedef struct hot_iter {
+    hot_step *path;
+    int depth, cap;
+    hot_leaf *leaf;
+} hot_iter;
+
+static int iter_push(hot_iter *it, hot_node *node, int index) {
+    if(it->depth == it->cap) {
+        int cap = it->cap ? it->cap * 2 : 16;
+        hot_step *path = realloc(it->path, cap * sizeof(hot_step));
+        if(!path)
+            return 1;
+        it->path = path;
+        it->cap = cap;
+    }
+    it->path[it->depth].node = node;
+    it->path[it->depth].index = index;
+    ++it->depth;
+    return 0;
+}
+
+static void iter_leftmost(hot_iter *it, void *p) {
+    while(IS_INTERNAL(p)) {
+        hot_node *node = TO_NODE(p);
+        if(iter_push(it, node, 0)) {
+            it->leaf = NULL;
+            return;
+        }
+        p = node_children(node)[0];
+    }
+    it->leaf = p;
+}
+
+static void iter_next(hot_iter *it) {
+    while(it->depth) {
+        hot_step *step = &it->path[it->depth - 1];
+        if(++step->index < step->node->n) {
+            iter_leftmost(it, node_children(step->node)[step->index]);
+            return;
+        }
+        --it->depth;
+    }
+    it->leaf = NULL;
+}
+
+// positions the iterator at the first key >= key
+static void iter_seek(hot_iter *it, void *head, const uint8_t *key, size_t len) {
+    it->depth = 0;
+    it->leaf = NULL;
+    if(!head)
+        return;
+
+    hot_leaf *nearest = find_nearest(head, key, len);
+    uint32_t crit = key_critpos(nearest->key, nearest->len, key, len);
+    int dir = crit == POS_NONE ? 0 : key_bit(key, len, crit);
+
+    // go down while the tests come before crit. the subtree we stop at
+    // shares everything up to crit with nearest, so key sorts either
+    // before or after all of it
+    void *p = head;
+    while(IS_INTERNAL(p)) {
+        hot_node *node = TO_NODE(p);
+        const uint32_t *sparse = node_sparse(node);
+        uint32_t positions[HOT_MAX_ENTRIES];
+        int nbits = node_positions(node, positions);
+
+        int a = 0, b = node->n - 1;
+        while(a < b) {
+            uint32_t any = 0, all = ~0u;
+            int i;
+            for(i = a; i <= b; i++) {
+                any |= sparse[i];
+                all &= sparse[i];
+            }
+            int bit = 31 - __builtin_clz(any ^ all);
+            if(positions[nbits - 1 - bit] > crit)
+                break;
+
+            int m = a;
+            while(!((sparse[m] >> bit) & 1))
+                ++m;
+            if(key_bit(key, len, positions[nbits - 1 - bit]))
+                a = m;
+            else
+                b = m - 1;
+        }
+
+        void *child = node_children(node)[a];
+        if(a == b && IS_INTERNAL(child) && TO_NODE(child)->rootpos < crit) {
+            if(iter_push(it, node, a))
+                return;
+            p = child;
+            continue;
+        }
+
+        if(dir) {
+            if(iter_push(it, node, b))
+                return;
+            iter_next(it);
+        } else {
+            if(iter_push(it, node, a))
+                return;
+            iter_leftmost(it, child);
+        }
+        return;
+    }
+
+    if(!dir)
+        it->leaf = p;
+}
+
+static int key_compare(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen) {
+    int ret = memcmp(a, b, alen < blen ? alen : blen);
+    if(ret)
+        return ret;
+    return (alen > blen) - (alen < blen);
+}
+
+// Same contract as critbit_callback
+typedef int(*hot_callback)(void *data, const char *key, uint32_t key_len, void *value);
+
+// calls cb for every key in [lo, hi) in order. NULL bounds are unbounded
+int critbit_hot_range_len(critbit_hot *t,
+        const void *lo, size_t lolen, const void *hi, size_t hilen,
+        hot_callback cb, void *data) {
+    pthread_rwlock_rdlock(&t->lock);
+
+    hot_iter it = {NULL, 0, 0, NULL};
+    if(lo)
+        iter_seek(&it, t->head, lo, lolen);
+    else if(t->head)
+        iter_leftmost(&it, t->head);
+
+    int ret = 0;
+    while(it.leaf) {
+        hot_leaf *leaf = it.leaf;
+        if(hi && key_compare(leaf->key, leaf->len, hi, hilen) >= 0)
+            break;
+
+        ret = cb(data, (const char *)leaf->key, leaf->len, leaf->value);
+        if(ret)
+            break;
+        iter_next(&it);
+    }
+
+    pthread_rwlock_unlock(&t->lock);
+    free(it.path);
+    return ret;
+}
+
+int critbit_hot_range(critbit_hot *t, const char *lo, const char *hi,
+        hot_callback cb, void *data) {
+    return critbit_hot_range_len(t, lo, lo ? strlen(lo) : 0,
+            hi, hi ? strlen(hi) : 0, cb, data);
+}
+
+int critbit_hot_iter_prefix(critbit_hot *t, const char *prefix, int prefix_len,
+        hot_callback cb, void *data) {
+    pthread_rwlock_rdlock(&t->lock);
+
+    hot_iter it = {NULL, 0, 0, NULL};
+    iter_seek(&it, t->head, (const uint8_t *)prefix, prefix_len);
+
+    int ret = 0;
+    while(it.leaf) {
+        hot_leaf *leaf = it.leaf;
+        if(leaf->len < (uint32_t)prefix_len || memcmp(leaf->key, prefix, prefix_len) != 0)
+            break;
+
+        ret = cb(data, (const char *)leaf->key, leaf->len, leaf->value);
+        if(ret)
+            break;
+        iter_next(&it);
+    }
+
+    pthread_rwlock_unlock(&t->lock);
+    free(it.path);
+    return ret;
+}
+
+static void clear_node(critbit_hot *t, void *p) {
+    if(!IS_INTERNAL(p)) {
+        free_leaf(t, p);
+        return;
+    }
+
+    hot_node *node = TO_NODE(p);
+    int i;
+    for(i = 0; i < node->n; i++) {
+        clear_node(t, node_children(node)[i]);
+    }
+    free_node(t, node);
+}
+
+void critbit_hot_clear(critbit_hot *t) {
+    if(t->head)
+        clear_node(t, t->head);
+    pthread_rwlock_destroy(&t->lock);
+    free(t);
+}
+
+#include "helper.h"
+
+void* init(void) {
+    return critbit_hot_new();
+}
+
+int add(void *obj, const char *key, void *val) {
+    critbit_hot *t = obj;
+    return critbit_hot_insert(t, key, val);
+}
+
+void* find(void *obj, const char *key) {
+    critbit_hot *t = obj;
+    void *out = NULL;
+    critbit_hot_get(t, key, &out);
+    return out;
+}
+
+int del(void *obj, const char *key) {
+    critbit_hot *t = obj;
+    return critbit_hot_delete(t, key);
+}
+
+void clear(void *obj) {
+    critbit_hot *t = obj;
+    critbit_hot_clear(t);
+}
+
+const int concurrent_writes = 1;
+
+int iter_prefix(void *obj, const char *prefix, int prefix_len,
+        iter_callback cb, void *data) {
+    critbit_hot *t = obj;
+    return critbit_hot_iter_prefix(t, prefix, prefix_len, cb, data);
+}
+
+size_t memory_usage(void *obj) {
+    critbit_hot *t = obj;
+    return t->bytes;
+}
+
+void fill_depth(void *ptr, int depth, int *out, int outsize) {
+    if(!IS_INTERNAL(ptr)) {
+        // leaves below the histogram aren't counted
+        if(depth >= outsize)
+            return;
+        ++out[depth];
+        return;
+    }
+
+    hot_node *node = TO_NODE(ptr);
+    int i;
+    for(i = 0; i < node->n; i++) {
+        fill_depth(node_children(node)[i], depth+1, out, outsize);
+    }
+}
+
+#define DEPTH_SIZE 100
+void info(void *obj) {
+    critbit_hot *t = obj;
+    int depth_dist[DEPTH_SIZE];
+    memset(depth_dist, 0, sizeof(depth_dist));
+    if(t->head)
+        fill_depth(t->head, 0, depth_dist, DEPTH_SIZE);
+
+    int i;
+    for(i = 0; i < DEPTH_SIZE; i++) {
+        if(depth_dist[i] == 0)
+            continue;
+        printf("%d:\t%d\n", i, depth_dist[i]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,302 @@
+// Critical-bit tree over fixed-width unsigned integer keys. Included by
+// critbit.c once per key type, with
+//   CRITBIT_INT_NAME  the suffix of every name, as in critbit_u64_get
+//   CRITBIT_INT_TYPE  the key type
+// the declarations come from CRITBIT_INT_DECLARE in critbit_common.h.
+//
+// Keys compare as numbers. A node keeps the shift of the bit it tests, so
+// the direction is (key >> shift) & 1, and the critical bit of two keys is
+// the highest one set in their xor. Leaves have a fixed size and hold the
+// key and value. A tree is at most as deep as the key is wide, so walks
+// need no more than that on their stacks.
+//
+// Readers take no locks, writers are serialized by wlock and retire what
+// they unlink through ebr.h like critbit_root does.
+
+#define CRITBIT_INT_CAT2(a, b) a##b
+#define CRITBIT_INT_CAT(a, b) CRITBIT_INT_CAT2(a, b)
+#define CI_T CRITBIT_INT_CAT(critbit_, CRITBIT_INT_NAME)
+#define CI(name) CRITBIT_INT_CAT(CI_T, _##name)
+#define CI_KEY CRITBIT_INT_TYPE
+#define CI_BITS (int)(sizeof(CI_KEY) * 8)
+
+typedef struct CI(node) {
+    void *child[2];
+    uint8_t shift;
+} CI(node);
+
+typedef struct CI(leaf) {
+    CI_KEY key;
+    void *value;
+} CI(leaf);
+
+struct CI_T {
+    void *head;
+    size_t count;
+
+#ifndef CRITBIT_MALLOC
+    slab_pool nodes;
+    slab_pool leaves;
+#endif
+
+    pthread_mutex_t wlock;
+    ebr_limbo limbo;
+};
+
+#ifdef CRITBIT_MALLOC
+#define CI_ALLOC(t, pool, type) ((void)(t), malloc(sizeof(type)))
+#define CI_FREE(t, pool, p) ((void)(t), free(p))
+#else
+#define CI_ALLOC(t, pool, type) slab_alloc(&(t)->pool)
+#define CI_FREE(t, pool, p) slab_free(&(t)->pool, p)
+#endif
+
+// shift of the highest bit in which a and b differ, which must not be equal
+static inline int CI(crit_shift)(CI_KEY a, CI_KEY b) {
+    // widened so that one expression serves every width, the high half
+    // is known to be zero below 128 bits and is dropped at compile time
+    unsigned __int128 diff = a ^ b;
+    uint64_t high = diff >> 64;
+    if(high)
+        return 64 + 63 - __builtin_clzll(high);
+    return 63 - __builtin_clzll((uint64_t)diff);
+}
+
+static inline int CI(direction)(const CI(node) *node, CI_KEY key) {
+    return (key >> node->shift) & 1;
+}
+
+CI_T *CI(new)(void) {
+    CI_T *t = malloc(sizeof(CI_T));
+    if(!t)
+        return NULL;
+    t->head = NULL;
+    t->count = 0;
+#ifndef CRITBIT_MALLOC
+    slab_init(&t->nodes, sizeof(CI(node)));
+    slab_init(&t->leaves, sizeof(CI(leaf)));
+#endif
+    t->wlock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    ebr_limbo_init(&t->limbo);
+    return t;
+}
+
+static void CI(free_item)(void *ctx, void *p) {
+    CI_T *t = ctx;
+    if(IS_INTERNAL(p))
+        CI_FREE(t, nodes, TO_NODE(p));
+    else
+        CI_FREE(t, leaves, p);
+}
+
+#ifdef CRITBIT_MALLOC
+static void CI(free_tree)(CI_T *t, void *p) {
+    if(IS_INTERNAL(p)) {
+        CI(node) *node = TO_NODE(p);
+        CI(free_tree)(t, node->child[0]);
+        CI(free_tree)(t, node->child[1]);
+    }
+    CI(free_item)(t, p);
+}
+#endif
+
+void CI(free)(CI_T *t) {
+    if(!t)
+        return;
+    ebr_limbo_destroy(&t->limbo, CI(free_item), t);
+#ifdef CRITBIT_MALLOC
+    if(t->head)
+        CI(free_tree)(t, t->head);
+#else
+    slab_release(&t->nodes);
+    slab_release(&t->leaves);
+#endif
+    free(t);
+}
+
+size_t CI(count)(CI_T *t) {
+    return t->count;
+}
+
+static void *CI(nearest)(void *p, CI_KEY key) {
+    while(IS_INTERNAL(p)) {
+        CI(node) *node = TO_NODE(p);
+        p = node->child[CI(direction)(node, key)];
+    }
+    return p;
+}
+
+int CI(get)(CI_T *t, CI_KEY key, void **out) {
+    int ret = 1;
+    ebr_enter();
+    void *p = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    if(p) {
+        CI(leaf) *leaf = CI(nearest)(p, key);
+        if(leaf->key == key) {
+            *out = leaf->value;
+            ret = 0;
+        }
+    }
+    ebr_exit();
+    return ret;
+}
+
+int CI(insert)(CI_T *t, CI_KEY key, const void *value) {
+    pthread_mutex_lock(&t->wlock);
+
+    int ret = 1;
+    CI(leaf) *leaf = NULL;
+    void **slot = &t->head;
+    if(t->head) {
+        CI(leaf) *nearest = CI(nearest)(t->head, key);
+        if(nearest->key == key)
+            goto out;
+
+        int shift = CI(crit_shift)(nearest->key, key);
+        while(IS_INTERNAL(*slot)) {
+            CI(node) *node = TO_NODE(*slot);
+            if(node->shift < shift)
+                break;
+            slot = &node->child[CI(direction)(node, key)];
+        }
+
+        CI(node) *node = CI_ALLOC(t, nodes, CI(node));
+        leaf = CI_ALLOC(t, leaves, CI(leaf));
+        if(!node || !leaf) {
+            if(node)
+                CI_FREE(t, nodes, node);
+            goto nomem;
+        }
+        int dir = (key >> shift) & 1;
+        node->shift = shift;
+        node->child[dir] = leaf;
+        node->child[!dir] = *slot;
+        leaf->key = key;
+        leaf->value = (void *)value;
+        __atomic_store_n(slot, FROM_NODE(node), __ATOMIC_RELEASE);
+    } else {
+        leaf = CI_ALLOC(t, leaves, CI(leaf));
+        if(!leaf)
+            goto nomem;
+        leaf->key = key;
+        leaf->value = (void *)value;
+        __atomic_store_n(slot, leaf, __ATOMIC_RELEASE);
+    }
+
+    ++t->count;
+    ret = 0;
+    goto out;
+
+nomem:
+    if(leaf)
+        CI_FREE(t, leaves, leaf);
+    ret = -1;
+out:
+    pthread_mutex_unlock(&t->wlock);
+    return ret;
+}
+
+static void CI(retire)(CI_T *t, void *p) {
+    // without room in the limbo, wait out the readers and free it here
+    if(ebr_retire(&t->limbo, p)) {
+        ebr_synchronize();
+        CI(free_item)(t, p);
+    }
+}
+
+int CI(delete)(CI_T *t, CI_KEY key) {
+    pthread_mutex_lock(&t->wlock);
+
+    int ret = 1;
+    void **slot = &t->head, **parent = NULL;
+    if(!t->head)
+        goto out;
+    while(IS_INTERNAL(*slot)) {
+        CI(node) *node = TO_NODE(*slot);
+        parent = slot;
+        slot = &node->child[CI(direction)(node, key)];
+    }
+
+    CI(leaf) *leaf = *slot;
+    if(leaf->key != key)
+        goto out;
+
+    if(parent) {
+        CI(node) *node = TO_NODE(*parent);
+        void *sibling = node->child[slot == &node->child[0]];
+        __atomic_store_n(parent, sibling, __ATOMIC_RELEASE);
+        CI(retire)(t, FROM_NODE(node));
+    } else {
+        __atomic_store_n(&t->head, NULL, __ATOMIC_RELEASE);
+    }
+    CI(retire)(t, leaf);
+
+    if(t->limbo.pending >= RECLAIM_BATCH)
+        ebr_collect(&t->limbo, CI(free_item), t);
+
+    --t->count;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&t->wlock);
+    return ret;
+}
+
+// calls cb for every key in [lo, hi] in order. returns 0, or the return
+// of the callback that stopped the walk
+int CI(range)(CI_T *t, CI_KEY lo, CI_KEY hi, CI(callback) cb, void *data) {
+    void *stack[CI_BITS + 1];
+    int sp = 0, ret = 0;
+
+    ebr_enter();
+    void *p = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    if(!p || lo > hi)
+        goto out;
+
+    // find where the keys >= lo start. above the critical bit of lo and
+    // its nearest leaf, every key agrees with lo, and the right siblings
+    // of the way down are greater. below it, a subtree is all greater or
+    // all smaller than lo
+    CI(leaf) *nearest = CI(nearest)(p, lo);
+    int shift = nearest->key == lo ? -1 : CI(crit_shift)(nearest->key, lo);
+    while(IS_INTERNAL(p)) {
+        CI(node) *node = TO_NODE(p);
+        if(node->shift < shift)
+            break;
+        int dir = CI(direction)(node, lo);
+        if(!dir)
+            stack[sp++] = node->child[1];
+        p = node->child[dir];
+    }
+    if(shift < 0 || !((lo >> shift) & 1))
+        stack[sp++] = p;
+
+    while(sp) {
+        p = stack[--sp];
+        while(IS_INTERNAL(p)) {
+            CI(node) *node = TO_NODE(p);
+            stack[sp++] = node->child[1];
+            p = node->child[0];
+        }
+        CI(leaf) *leaf = p;
+        if(leaf->key > hi)
+            break;
+        ret = cb(data, leaf->key, leaf->value);
+        if(ret)
+            break;
+    }
+
+out:
+    ebr_exit();
+    return ret;
+}
+
+#undef CI_ALLOC
+#undef CI_FREE
+#undef CI_BITS
+#undef CI_KEY
+#undef CI
+#undef CI_T
+#undef CRITBIT_INT_CAT
+#undef CRITBIT_INT_CAT2
+#undef CRITBIT_INT_NAME
+#undef CRITBIT_INT_TYPE
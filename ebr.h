@@ -0,0 +1,205 @@
+// Epoch-based reclamation
+
+#ifndef EBR_H
+#define EBR_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Readers announce the global epoch in a per-thread slot for the duration of
+// a critical section, and don't touch any shared lock. Writers retire
+// unlinked memory into the bag of the current epoch. The epoch only advances
+// once every active reader has caught up with it, so anything retired two
+// epochs ago can no longer be reached and is freed.
+
+typedef struct ebr_slot {
+    // 0 outside of a critical section, the announced epoch otherwise
+    volatile unsigned long epoch;
+    int nesting;
+    int used;
+    struct ebr_slot *next;
+} __attribute__((aligned(64))) ebr_slot;
+
+static volatile unsigned long ebr_epoch = 1;
+static ebr_slot *volatile ebr_slots;
+static pthread_mutex_t ebr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ebr_key;
+static __thread ebr_slot *ebr_self;
+
+static inline void ebr_thread_exit(void *ptr) {
+    ebr_slot *slot = ptr;
+    slot->epoch = 0;
+    slot->nesting = 0;
+    __sync_synchronize();
+    slot->used = 0;
+}
+
+static inline void ebr_init_key(void) {
+    pthread_key_create(&ebr_key, ebr_thread_exit);
+}
+
+static inline ebr_slot *ebr_register(void) {
+    pthread_once(&ebr_once, ebr_init_key);
+
+    // slots are never freed, a dead thread's slot is handed to a new one
+    pthread_mutex_lock(&ebr_lock);
+    ebr_slot *slot;
+    for(slot = ebr_slots; slot; slot = slot->next) {
+        if(!slot->used)
+            break;
+    }
+    if(!slot) {
+        if(posix_memalign((void **)&slot, sizeof(ebr_slot), sizeof(ebr_slot)))
+            abort();
+        memset(slot, 0, sizeof(ebr_slot));
+        slot->next = ebr_slots;
+        __sync_synchronize();
+        ebr_slots = slot;
+    }
+    slot->used = 1;
+    pthread_mutex_unlock(&ebr_lock);
+
+    pthread_setspecific(ebr_key, slot);
+    ebr_self = slot;
+    return slot;
+}
+
+static inline void ebr_enter(void) {
+    ebr_slot *slot = ebr_self;
+    if(!slot)
+        slot = ebr_register();
+    if(slot->nesting++)
+        return;
+
+    unsigned long epoch;
+    do {
+        epoch = ebr_epoch;
+        slot->epoch = epoch;
+        __sync_synchronize();
+    } while(epoch != ebr_epoch);
+}
+
+static inline void ebr_exit(void) {
+    ebr_slot *slot = ebr_self;
+    if(--slot->nesting)
+        return;
+
+    __sync_synchronize();
+    slot->epoch = 0;
+}
+
+// moves the global epoch forward if every active reader has observed it.
+// returns the current epoch
+static inline unsigned long ebr_try_advance(void) {
+    unsigned long epoch = ebr_epoch;
+    __sync_synchronize();
+
+    ebr_slot *slot;
+    for(slot = ebr_slots; slot; slot = slot->next) {
+        unsigned long e = slot->epoch;
+        if(e && e != epoch)
+            return epoch;
+    }
+
+    __sync_val_compare_and_swap(&ebr_epoch, epoch, epoch + 1);
+    return ebr_epoch;
+}
+
+// waits until every reader that might see memory retired so far is gone.
+// must not be called from inside a critical section
+static inline void ebr_synchronize(void) {
+    unsigned long target = ebr_epoch + 2;
+    while((long)(ebr_try_advance() - target) < 0) {
+        sched_yield();
+    }
+}
+
+// Retired memory, kept per owner so it can be returned to the right
+// allocator. Not thread-safe, the owner serializes access.
+typedef void (*ebr_free_func)(void *ctx, void *ptr);
+
+typedef struct ebr_bag {
+    void **items;
+    size_t n, cap;
+    unsigned long epoch;
+} ebr_bag;
+
+typedef struct ebr_limbo {
+    ebr_bag bags[3];
+    size_t pending;
+} ebr_limbo;
+
+static inline void ebr_limbo_init(ebr_limbo *limbo) {
+    memset(limbo, 0, sizeof(*limbo));
+}
+
+static inline void ebr_bag_free(ebr_limbo *limbo, ebr_bag *bag,
+        ebr_free_func func, void *ctx) {
+    size_t i;
+    for(i = 0; i < bag->n; i++) {
+        func(ctx, bag->items[i]);
+    }
+    limbo->pending -= bag->n;
+    bag->n = 0;
+}
+
+// frees every bag that is at least two epochs old
+static inline void ebr_collect(ebr_limbo *limbo, ebr_free_func func, void *ctx) {
+    unsigned long epoch = ebr_try_advance();
+
+    int i;
+    for(i = 0; i < 3; i++) {
+        ebr_bag *bag = &limbo->bags[i];
+        if(bag->n && (long)(epoch - bag->epoch) >= 2)
+            ebr_bag_free(limbo, bag, func, ctx);
+    }
+}
+
+// queues ptr to be freed after a grace period. returns 1 if the item
+// couldn't be queued, it's still owned by the caller then
+static inline int ebr_retire(ebr_limbo *limbo, void *ptr) {
+    // the unlink must be visible before the epoch is sampled
+    __sync_synchronize();
+    unsigned long epoch = ebr_epoch;
+
+    // a bag still holding items from three epochs ago is simply relabeled,
+    // freeing later than necessary is always safe
+    ebr_bag *bag = &limbo->bags[epoch % 3];
+    bag->epoch = epoch;
+
+    if(bag->n == bag->cap) {
+        size_t cap = bag->cap ? bag->cap * 2 : 64;
+        void **items = realloc(bag->items, cap * sizeof(void *));
+        if(!items)
+            return 1;
+        bag->items = items;
+        bag->cap = cap;
+    }
+    bag->items[bag->n++] = ptr;
+    ++limbo->pending;
+    return 0;
+}
+
+// moves every retired item into out, which must be empty. lets the caller
+// wait for a grace period without holding the owner's lock
+static inline void ebr_limbo_move(ebr_limbo *limbo, ebr_limbo *out) {
+    *out = *limbo;
+    ebr_limbo_init(limbo);
+}
+
+// frees everything regardless of readers, for teardown
+static inline void ebr_limbo_destroy(ebr_limbo *limbo, ebr_free_func func, void *ctx) {
+    int i;
+    for(i = 0; i < 3; i++) {
+        ebr_bag *bag = &limbo->bags[i];
+        if(func)
+            ebr_bag_free(limbo, bag, func, ctx);
+        free(bag->items);
+    }
+    ebr_limbo_init(limbo);
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include "helper.h"
 
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <stdint.h>
@@ -16,12 +17,34 @@ static int64_t current_usec(void) {
     return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+static int64_t current_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 typedef void (*measure_func)(void*, int);
 
+// resident set size in kilobytes, 0 if unknown
+static long current_rss_kb(void) {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if(!fp)
+        return 0;
+
+    long pages = 0, rss = 0;
+    if(fscanf(fp, "%ld %ld", &pages, &rss) != 2)
+        rss = 0;
+    fclose(fp);
+
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
 typedef struct stat {
     const char *name;
     int iter;
     int usec;
+    long rss_kb;
 } stat;
 
 #define MEASURE(obj, func, iter) measure(obj, #func, func, iter)
@@ -32,7 +55,7 @@ static stat measure(void *obj, const char *name, measure_func func, int iter) {
 
     int64_t diff = current_usec() - start;
 
-    stat s = {name, iter, diff};
+    stat s = {name, iter, diff, current_rss_kb()};
     return s;
 }
 
@@ -142,6 +165,35 @@ void get(void *obj, int iter) {
     }
 }
 
+// random `set` keys through find_batch, batch_size keys at a time. a
+// batch of 1 is the baseline
+#define MAX_BATCH 64
+int batch_size;
+void get_batch(void *obj, int iter) {
+    char buf[MAX_BATCH][20];
+    const char *keys[MAX_BATCH];
+    int want[MAX_BATCH];
+    void *out[MAX_BATCH];
+    int i, j, n;
+    srand(RANDOM_SEED);
+    for(i = 1; i < iter; i += n) {
+        n = iter - i < batch_size ? iter - i : batch_size;
+        for(j = 0; j < n; j++) {
+            want[j] = 1 + rand() % (iter - 1);
+            sprintf(buf[j], "%09d", want[j]);
+            keys[j] = buf[j];
+        }
+
+        find_batch(obj, keys, out, n);
+        for(j = 0; j < n; j++) {
+            if((size_t)out[j] != (size_t)want[j]) {
+                printf("Failed to get `%s`\n", buf[j]);
+                exit(-1);
+            }
+        }
+    }
+}
+
 #include <pthread.h>
 #define NUM_THREADS 32
 int thread_iter;
@@ -174,6 +226,261 @@ void get_threaded(void *obj, int iter) {
     }
 }
 
+// WRITERS threads insert, then delete, their own random keys at once.
+// Unlike the `set` keys these vary from the first byte on, which also
+// spreads them over the shards of a partitioned structure
+#define DEFAULT_WRITERS 8
+int num_writers;
+typedef struct writer_arg {
+    void *obj;
+    int id;
+    int insert;
+} writer_arg;
+
+static void fill_rand_r(char *out, int len, unsigned int *seed) {
+    int i;
+    for(i = 0; i < len; i++) {
+        out[i] = 1 + rand_r(seed) % 255;
+    }
+    out[len] = '\0';
+}
+
+void *write_thread(void *arg) {
+    writer_arg *w = arg;
+    unsigned int seed = RANDOM_SEED + w->id;
+    int i;
+    char buf[20];
+    for(i = 1 + w->id; i < thread_iter; i += num_writers) {
+        fill_rand_r(buf, 10, &seed);
+        void* val = (void *)(size_t)i;
+
+        if(w->insert ? add(w->obj, buf, val) : del(w->obj, buf)) {
+            printf("Failed to %s `%s`\n", w->insert ? "insert" : "delete", buf);
+            exit(-1);
+        }
+    }
+    return NULL;
+}
+
+static void run_writers(void *obj, int iter, int insert) {
+    pthread_t *threads = malloc(num_writers * sizeof(pthread_t));
+    writer_arg *args = malloc(num_writers * sizeof(writer_arg));
+    int i;
+    thread_iter = iter;
+    for(i = 0; i < num_writers; i++) {
+        args[i].obj = obj;
+        args[i].id = i;
+        args[i].insert = insert;
+        pthread_create(threads + i, NULL, write_thread, args + i);
+    }
+    for(i = 0; i < num_writers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(args);
+}
+
+void set_threaded(void *obj, int iter) {
+    run_writers(obj, iter, 1);
+}
+
+void del_threaded(void *obj, int iter) {
+    run_writers(obj, iter, 0);
+}
+
+static int prefix_visit(void *data, const char *key, uint32_t key_len, void *value) {
+    ++*(int *)data;
+    return 0;
+}
+
+// enumerates the keys of `set` by their first six digits, 1000 keys each
+#define PREFIX_DIGITS 6
+#define PREFIX_SPAN 1000
+int prefix_visited;
+void prefix_scan(void *obj, int iter) {
+    int i;
+    char buf[20];
+    prefix_visited = 0;
+    for(i = 0; i * PREFIX_SPAN < iter; ++i) {
+        sprintf(buf, "%0*d", PREFIX_DIGITS, i);
+
+        int lo = i ? i * PREFIX_SPAN : 1;
+        int hi = (i + 1) * PREFIX_SPAN < iter ? (i + 1) * PREFIX_SPAN : iter;
+        int count = 0;
+        iter_prefix(obj, buf, PREFIX_DIGITS, prefix_visit, &count);
+        if(count != hi - lo) {
+            printf("Prefix `%s` has %d keys, expected %d\n", buf, count, hi - lo);
+            exit(-1);
+        }
+        prefix_visited += count;
+    }
+}
+
+// random keys between two `set` keys, each one finds the next
+void lower_bound_rand(void *obj, int iter) {
+    int i;
+    char buf[20];
+    srand(RANDOM_SEED);
+    for(i = 1; i < iter; ++i) {
+        int n = rand() % (iter - 1);
+        sprintf(buf, "%09d5", n);
+        void *out = lower_bound(obj, buf);
+        if((size_t)out != (n + 1 < iter ? (size_t)n + 1 : 0)) {
+            printf("Failed lower bound of `%s`\n", buf);
+            exit(-1);
+        }
+    }
+}
+
+// the same keys as lower_bound_rand, the `set` keys up to n are before each
+void rank_rand(void *obj, int iter) {
+    int i;
+    char buf[20];
+    srand(RANDOM_SEED);
+    for(i = 1; i < iter; ++i) {
+        int n = rand() % (iter - 1);
+        sprintf(buf, "%09d5", n);
+        size_t rank = key_rank(obj, buf);
+        if(rank != (size_t)n) {
+            printf("Rank of `%s` is %zu, expected %d\n", buf, rank, n);
+            exit(-1);
+        }
+    }
+}
+
+void select_rand(void *obj, int iter) {
+    int i;
+    srand(RANDOM_SEED);
+    for(i = 1; i < iter; ++i) {
+        int k = rand() % (iter - 1);
+        void *out = key_select(obj, k);
+        if((size_t)out != (size_t)k + 1) {
+            printf("Failed to select key %d\n", k);
+            exit(-1);
+        }
+    }
+}
+
+// deletes every key and re-inserts it with a longer one, then restores it;
+// exercises the allocator with frees and allocations of mixed sizes
+#define CHURN_OPS 4
+void churn(void *obj, int iter) {
+    int i;
+    char buf[20], longbuf[40];
+    for(i = 1; i < iter; ++i) {
+        sprintf(buf, "%09d", i);
+        sprintf(longbuf, "%09d%.*s", i, i % 24, "xxxxxxxxxxxxxxxxxxxxxxxx");
+        void* val = (void *)(size_t)i;
+
+        if(del(obj, buf) || add(obj, longbuf, val) ||
+                del(obj, longbuf) || add(obj, buf, val)) {
+            printf("Failed to churn `%s`\n", buf);
+            exit(-1);
+        }
+    }
+}
+
+// delete latency percentiles while NUM_THREADS readers run
+static volatile int latency_stop;
+int64_t del_p50, del_p99, del_max;
+
+void *latency_reader(void *obj) {
+    unsigned int seed = (size_t)&seed;
+    char buf[20];
+    while(!latency_stop) {
+        sprintf(buf, "%09d", 1 + rand_r(&seed) % thread_iter);
+        find(obj, buf);
+    }
+    return NULL;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+void del_latency(void *obj, int iter) {
+    pthread_t threads[NUM_THREADS];
+    int i;
+    thread_iter = iter;
+    latency_stop = 0;
+    for(i = 0; i < NUM_THREADS; i++) {
+        pthread_create(threads + i, NULL, latency_reader, obj);
+    }
+
+    int64_t *lat = malloc(iter * sizeof(int64_t));
+    char buf[20];
+    for(i = 1; i < iter; ++i) {
+        sprintf(buf, "%09d", i);
+        void* val = (void *)(size_t)i;
+
+        int64_t start = current_nsec();
+        int ret = del(obj, buf);
+        lat[i - 1] = current_nsec() - start;
+
+        if(ret || add(obj, buf, val)) {
+            printf("Failed to delete `%s`\n", buf);
+            exit(-1);
+        }
+    }
+
+    latency_stop = 1;
+    for(i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int n = iter - 1;
+    if(n > 0) {
+        qsort(lat, n, sizeof(int64_t), cmp_int64);
+        del_p50 = lat[n / 2];
+        del_p99 = lat[(int)(n * 0.99)];
+        del_max = lat[n - 1];
+    }
+    free(lat);
+}
+
+// bulk loads the `set` keys, in order, and the `set_rand` ones into an
+// object of their own. the keys are made up front
+static char (*build_buf)[20];
+static const char **build_keys;
+static void **build_vals;
+static void *built;
+
+static void build_prepare(int iter, int sorted) {
+    if(!build_buf) {
+        build_buf = malloc(iter * sizeof(*build_buf));
+        build_keys = malloc(iter * sizeof(char *));
+        build_vals = malloc(iter * sizeof(void *));
+    }
+
+    srand(RANDOM_SEED);
+    int i;
+    for(i = 1; i < iter; ++i) {
+        if(sorted)
+            sprintf(build_buf[i - 1], "%09d", i);
+        else
+            fill_rand(build_buf[i - 1], 10);
+        build_keys[i - 1] = build_buf[i - 1];
+        build_vals[i - 1] = (void *)(size_t)i;
+    }
+}
+
+static void build_check(int iter) {
+    int i;
+    for(i = 1; i < iter; ++i) {
+        if(find(built, build_keys[i - 1]) != build_vals[i - 1]) {
+            printf("Failed to build `%s`\n", build_keys[i - 1]);
+            exit(-1);
+        }
+    }
+    clear(built);
+}
+
+// the keys are sorted or not as build_prepare made them
+void bulk_build(void *obj, int iter) {
+    built = build(build_keys, build_vals, iter - 1);
+}
+
 void cleanup_rand(void *obj, int iter) {
     srand(RANDOM_SEED);
     int i;
@@ -198,6 +505,238 @@ void cleanup(void *obj, int iter) {
     }
 }
 
+// A synthetic routing table of IPv4 and IPv6 prefixes, about as many as
+// there are `set` keys. Keys are the family followed by the prefix bits
+// as '0' and '1', so a route is a key prefix of every address it covers.
+// Lookups are addresses under a random route, or anywhere at all.
+typedef struct fib_entry {
+    uint8_t family;
+    uint8_t len;
+    uint8_t addr[16];
+} fib_entry;
+
+static fib_entry *fib_routes, *fib_queries;
+static int *fib_expect;
+static int fib_nroutes;
+static char fib_lens[2][129];
+
+static int fib_key(char *out, const fib_entry *e) {
+    int i;
+    out[0] = e->family == 4 ? '4' : '6';
+    for(i = 0; i < e->len; i++) {
+        out[1 + i] = '0' + ((e->addr[i / 8] >> (7 - i % 8)) & 1);
+    }
+    out[1 + e->len] = '\0';
+    return 1 + e->len;
+}
+
+static int fib_route_len(int family) {
+    int r = rand() % 100;
+    if(family == 4)
+        return r < 55 ? 24 : r < 65 ? 8 + rand() % 8 : r < 95 ? 16 + rand() % 8 : 25 + rand() % 8;
+    return r < 45 ? 48 : r < 65 ? 32 : r < 95 ? 29 + rand() % 20 : 49 + rand() % 16;
+}
+
+void fib_prepare(int iter) {
+    int i, j;
+    srand(RANDOM_SEED);
+    fib_nroutes = iter - 1;
+    fib_routes = malloc(fib_nroutes * sizeof(fib_entry));
+    fib_queries = malloc(fib_nroutes * sizeof(fib_entry));
+    fib_expect = malloc(fib_nroutes * sizeof(int));
+    for(i = 0; i < fib_nroutes; i++) {
+        fib_entry *e = &fib_routes[i];
+        e->family = rand() % 5 ? 4 : 6;
+        e->len = fib_route_len(e->family);
+        for(j = 0; j < 16; j++) {
+            e->addr[j] = rand();
+        }
+    }
+
+    for(i = 0; i < fib_nroutes; i++) {
+        fib_entry *q = &fib_queries[i];
+        *q = fib_routes[rand() % fib_nroutes];
+        int keep = rand() % 8 ? q->len : 0;
+        q->len = q->family == 4 ? 32 : 128;
+        for(j = keep; j < q->len; j++) {
+            if(rand() & 1)
+                q->addr[j / 8] ^= 1 << (7 - j % 8);
+        }
+    }
+}
+
+void fib_load(void *obj, int iter) {
+    char buf[130];
+    int i;
+    memset(fib_lens, 0, sizeof(fib_lens));
+    for(i = 0; i < fib_nroutes; i++) {
+        fib_key(buf, &fib_routes[i]);
+        // routes drawn twice are simply not added again
+        if(!add(obj, buf, (void *)(size_t)(i + 1)))
+            fib_lens[fib_routes[i].family == 6][fib_routes[i].len] = 1;
+    }
+}
+
+// the usual way without longest_prefix: a lookup for every route length
+// in the table, longest first
+void fib_get(void *obj, int iter) {
+    char buf[130];
+    int i, len;
+    for(i = 0; i < fib_nroutes; i++) {
+        const fib_entry *q = &fib_queries[i];
+        const char *lens = fib_lens[q->family == 6];
+        fib_key(buf, q);
+        fib_expect[i] = -1;
+        for(len = q->len; len >= 0; len--) {
+            if(!lens[len])
+                continue;
+            char c = buf[1 + len];
+            buf[1 + len] = '\0';
+            void *out = find(obj, buf);
+            buf[1 + len] = c;
+            if(out) {
+                fib_expect[i] = len;
+                break;
+            }
+        }
+    }
+}
+
+void fib_lpm(void *obj, int iter) {
+    char buf[130];
+    int i;
+    for(i = 0; i < fib_nroutes; i++) {
+        fib_key(buf, &fib_queries[i]);
+        void *out;
+        int len = longest_prefix(obj, buf, &out);
+        // the key length counts the family too
+        if((len < 0 ? -1 : len - 1) != fib_expect[i]) {
+            printf("Longest prefix of `%s` is %d long, expected %d\n", buf, len - 1, fib_expect[i]);
+            exit(-1);
+        }
+    }
+}
+
+void fib_unload(void *obj, int iter) {
+    char buf[130];
+    int i;
+    for(i = 0; i < fib_nroutes; i++) {
+        fib_key(buf, &fib_routes[i]);
+        del(obj, buf);
+    }
+    free(fib_routes);
+    free(fib_queries);
+    free(fib_expect);
+}
+
+// Two sets of iter - 1 keys, sharing about overlap percent of them. The
+// keys of b that aren't in a sit right after one of a, so the two sets are
+// interleaved all the way through.
+static void *setop_a, *setop_b, *setop_result;
+static int setop_size, setop_shared;
+
+void setop_prepare(int iter, int overlap) {
+    int i;
+    char buf[20];
+    srand(RANDOM_SEED);
+    setop_a = init();
+    setop_b = init();
+    setop_size = iter - 1;
+    setop_shared = 0;
+    for(i = 1; i < iter; ++i) {
+        sprintf(buf, "%09d", i);
+        add(setop_a, buf, (void *)(size_t)i);
+        if(rand() % 100 < overlap) {
+            ++setop_shared;
+        } else {
+            strcat(buf, "5");
+        }
+        add(setop_b, buf, (void *)(size_t)i);
+    }
+}
+
+// the way without set operations, a lookup in b for every key of a
+void setop_get(void *obj, int iter) {
+    int i, shared = 0;
+    char buf[20];
+    for(i = 1; i < iter; ++i) {
+        sprintf(buf, "%09d", i);
+        if(find(setop_b, buf))
+            ++shared;
+    }
+    if(shared != setop_shared) {
+        printf("Found %d keys in both sets, expected %d\n", shared, setop_shared);
+        exit(-1);
+    }
+}
+
+void setop_union(void *obj, int iter) {
+    setop_result = set_union(setop_a, setop_b);
+}
+
+void setop_intersect(void *obj, int iter) {
+    setop_result = set_intersect(setop_a, setop_b);
+}
+
+void setop_difference(void *obj, int iter) {
+    setop_result = set_difference(setop_a, setop_b);
+}
+
+// counts the keys of the result of the last operation, then drops it
+void setop_check(int expect) {
+    if(!setop_result) {
+        printf("Set operation failed\n");
+        exit(-1);
+    }
+    int count = expect;
+    if(iter_prefix) {
+        count = 0;
+        iter_prefix(setop_result, "", 0, prefix_visit, &count);
+    }
+    if(count != expect) {
+        printf("Set operation gave %d keys, expected %d\n", count, expect);
+        exit(-1);
+    }
+    clear(setop_result);
+    setop_result = NULL;
+}
+
+void setop_release(void) {
+    clear(setop_a);
+    clear(setop_b);
+}
+
+// `set`, `get` and `cleanup` on integer IDs
+void set_id(void *obj, int iter) {
+    int i;
+    for(i = 1; i < iter; ++i) {
+        if(add_id(obj, i, (void *)(size_t)i)) {
+            printf("Failed to insert %d\n", i);
+            exit(-1);
+        }
+    }
+}
+
+void get_id(void *obj, int iter) {
+    int i;
+    for(i = 1; i < iter; ++i) {
+        if((size_t)find_id(obj, i) != (size_t)i) {
+            printf("Failed to get %d\n", i);
+            exit(-1);
+        }
+    }
+}
+
+void cleanup_id(void *obj, int iter) {
+    int i;
+    for(i = 1; i < iter; ++i) {
+        if(del_id(obj, i)) {
+            printf("Failed to delete %d\n", i);
+            exit(-1);
+        }
+    }
+}
+
 static const char *opt_str(const char *name) {
     return getenv(name);
 }
@@ -216,12 +755,18 @@ int main(void) {
     void *obj = init();
 
     int size = 0;
-    stat stats[20];
+    stat stats[48];
 
     stats[size++] = MEASURE(obj, set_rand, iter);
     stats[size++] = MEASURE(obj, get_rand, iter);
     stats[size++] = MEASURE(obj, cleanup_rand, iter);
 
+    if(&concurrent_writes && concurrent_writes) {
+        num_writers = opt_int("WRITERS", DEFAULT_WRITERS);
+        stats[size++] = MEASURE(obj, set_threaded, iter);
+        stats[size++] = MEASURE(obj, del_threaded, iter);
+    }
+
     /*
     stats[size++] = MEASURE(obj, set, iter);
     stats[size++] = MEASURE(obj, get, iter);
@@ -229,15 +774,91 @@ int main(void) {
     */
 
     stats[size++] = MEASURE(obj, set, iter);
+    size_t mem_bytes = memory_usage ? memory_usage(obj) : 0;
+    if(iter_prefix) {
+        stats[size++] = MEASURE(obj, prefix_scan, iter);
+        stats[size-1].iter = prefix_visited;
+    }
+    if(find_batch) {
+        for(batch_size = 1; batch_size <= MAX_BATCH; batch_size *= batch_size == 1 ? 8 : 2) {
+            stats[size++] = MEASURE(obj, get_batch, iter);
+        }
+    }
+    if(lower_bound)
+        stats[size++] = MEASURE(obj, lower_bound_rand, iter);
+    if(key_rank) {
+        stats[size++] = MEASURE(obj, rank_rand, iter);
+        stats[size++] = MEASURE(obj, select_rand, iter);
+    }
     stats[size++] = MEASURE(obj, get_threaded, iter);
     stats[size-1].iter *= NUM_THREADS;
+    // behind a lock that favours readers, the deletes would never get in
+    if(&concurrent_writes && concurrent_writes)
+        stats[size++] = MEASURE(obj, del_latency, iter);
+    stats[size++] = MEASURE(obj, churn, iter);
+    stats[size-1].iter *= CHURN_OPS;
     stats[size++] = MEASURE(obj, cleanup, iter);
 
+    if(build) {
+        int sorted;
+        for(sorted = 1; sorted >= 0; sorted--) {
+            build_prepare(iter, sorted);
+            stats[size++] = MEASURE(obj, bulk_build, iter);
+            build_check(iter);
+        }
+    }
+
+    if(longest_prefix) {
+        fib_prepare(iter);
+        stats[size++] = MEASURE(obj, fib_load, iter);
+        stats[size++] = MEASURE(obj, fib_get, iter);
+        stats[size++] = MEASURE(obj, fib_lpm, iter);
+        stats[size++] = MEASURE(obj, fib_unload, iter);
+    }
+
+    if(set_union) {
+        static const int overlaps[] = {1, 50, 99};
+        int o;
+        for(o = 0; o < 3; o++) {
+            setop_prepare(iter, overlaps[o]);
+            stats[size++] = MEASURE(obj, setop_get, iter);
+            stats[size++] = MEASURE(obj, setop_union, iter);
+            setop_check(2 * setop_size - setop_shared);
+            stats[size++] = MEASURE(obj, setop_intersect, iter);
+            setop_check(setop_shared);
+            stats[size++] = MEASURE(obj, setop_difference, iter);
+            setop_check(setop_size - setop_shared);
+            setop_release();
+        }
+    }
+
+    if(init_ids) {
+        void *ids = init_ids();
+        stats[size++] = MEASURE(ids, set_id, iter);
+        stats[size++] = MEASURE(ids, get_id, iter);
+        stats[size++] = MEASURE(ids, cleanup_id, iter);
+        clear_ids(ids);
+    }
+
     int i;
     printf("%.2f\t", iter / 1e6);
     for(i = 0; i < size; i++) {
         printf("%.2f\t", (stats[i].usec * 1e3f / stats[i].iter));
     }
+    printf("\n");
+
+    if(&concurrent_writes && concurrent_writes)
+        printf("del_ns\tp50 %lld\tp99 %lld\tmax %lld\n",
+                (long long)del_p50, (long long)del_p99, (long long)del_max);
+
+    if(memory_usage)
+        printf("mem\tbytes/key %.2f\n", (double)mem_bytes / (iter - 1));
+
+    // resident memory after each phase, in megabytes
+    printf("rss\t");
+    for(i = 0; i < size; i++) {
+        printf("%.2f\t", stats[i].rss_kb / 1024.0);
+    }
 
 
     clear(obj);
@@ -1,3 +1,5 @@
+#include <stddef.h>
+#include <stdint.h>
 
 void* init(void);
 
@@ -12,3 +14,49 @@ void clear(void *obj);
 
 // prints datastructure-specific stats
 void info(void *obj);
+
+// Optional operations. They're weak, so a benchmark which doesn't
+// implement one simply skips the phases using it.
+typedef int (*iter_callback)(void *data, const char *key, uint32_t key_len, void *value);
+
+// calls cb on every key with the given prefix, in order
+int iter_prefix(void *obj, const char *prefix, int prefix_len,
+        iter_callback cb, void *data) __attribute__((weak));
+
+// looks up n keys at once, out[i] is NULL for a missing key
+int find_batch(void *obj, const char *const *keys, void **out, int n) __attribute__((weak));
+
+// builds a new object holding n keys at once
+void *build(const char *const *keys, void *const *vals, int n) __attribute__((weak));
+
+// value of the first key >= key, NULL if there's none
+void *lower_bound(void *obj, const char *key) __attribute__((weak));
+
+// number of keys < key, and the value of the key with rank k, NULL if
+// there are no more keys
+size_t key_rank(void *obj, const char *key) __attribute__((weak));
+void *key_select(void *obj, size_t k) __attribute__((weak));
+
+// finds the longest key that is a prefix of key. returns its length, or
+// -1 if there's none
+int longest_prefix(void *obj, const char *key, void **val) __attribute__((weak));
+
+// new objects holding the keys in a or b, in both, and in a but not in b
+void *set_union(void *a, void *b) __attribute__((weak));
+void *set_intersect(void *a, void *b) __attribute__((weak));
+void *set_difference(void *a, void *b) __attribute__((weak));
+
+// The IDs of `set` as integers rather than formatted strings, in an
+// object of their own made by init_ids
+void *init_ids(void) __attribute__((weak));
+int add_id(void *obj, uint64_t id, void *val) __attribute__((weak));
+void *find_id(void *obj, uint64_t id) __attribute__((weak));
+int del_id(void *obj, uint64_t id) __attribute__((weak));
+void clear_ids(void *obj) __attribute__((weak));
+
+// bytes of memory held by the structure itself
+size_t memory_usage(void *obj) __attribute__((weak));
+
+// nonzero if add and del may be called from several threads at once, and
+// get in while readers keep running
+extern const int concurrent_writes __attribute__((weak));
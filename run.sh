@@ -1,6 +1,6 @@
 
 BINS='critbit.bin art.bin'
-make $BINS
+make $BINS critbit_sharded.bin
 
 echoerr() { echo "$@" 1>&2; }
 
@@ -16,3 +16,12 @@ do
         ITER=$iter time ./$bin 2>&1 | tee -a $FILENAME
     done
 done
+
+# shard count only matters for the threaded phases
+export FILENAME=critbit_sharded_batch.out
+rm -f $FILENAME
+for shards in 1 4 16 64;
+do
+    echoerr "critbit_sharded.bin SHARDS=$shards"
+    SHARDS=$shards ITER=333333 time ./critbit_sharded.bin 2>&1 | tee -a $FILENAME
+done
@@ -0,0 +1,214 @@
+// Slab allocator used for critbit nodes and leaves
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Objects of a single size are carved out of fixed-size chunks and recycled
+// through an intrusive free list. Chunks are never returned one by one; the
+// whole pool goes away at once in slab_release().
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_CHUNK_HEADER 16
+
+typedef struct slab_pool {
+    size_t size;
+    void *free;
+    uint8_t *cur, *end;
+    void *chunks;
+    size_t nchunks;
+} slab_pool;
+
+static inline void slab_init(slab_pool *pool, size_t size) {
+    memset(pool, 0, sizeof(*pool));
+    // keep objects pointer-aligned so the low bits are free for tagging
+    pool->size = (size + 7) & ~(size_t)7;
+}
+
+static inline void *slab_alloc(slab_pool *pool) {
+    void *p = pool->free;
+    if(p) {
+        pool->free = *(void **)p;
+        return p;
+    }
+
+    if(pool->cur + pool->size > pool->end) {
+        uint8_t *chunk = malloc(SLAB_CHUNK_SIZE);
+        if(!chunk)
+            return NULL;
+
+        *(void **)chunk = pool->chunks;
+        pool->chunks = chunk;
+        ++pool->nchunks;
+
+        pool->cur = chunk + SLAB_CHUNK_HEADER;
+        pool->end = chunk + SLAB_CHUNK_SIZE;
+    }
+
+    p = pool->cur;
+    pool->cur += pool->size;
+    return p;
+}
+
+static inline void slab_free(slab_pool *pool, void *p) {
+    *(void **)p = pool->free;
+    pool->free = p;
+}
+
+static inline void slab_release(slab_pool *pool) {
+    void *chunk = pool->chunks;
+    while(chunk) {
+        void *next = *(void **)chunk;
+        free(chunk);
+        chunk = next;
+    }
+    slab_init(pool, pool->size);
+}
+
+// takes over every object of from, which is left empty. both pools must
+// have the same object size
+static inline void slab_adopt(slab_pool *pool, slab_pool *from) {
+    void **tail = &pool->chunks;
+    while(*tail)
+        tail = (void **)*tail;
+    *tail = from->chunks;
+    pool->nchunks += from->nchunks;
+
+    tail = &pool->free;
+    while(*tail)
+        tail = (void **)*tail;
+    *tail = from->free;
+
+    // the rest of from's current chunk is simply lost
+    slab_init(from, from->size);
+}
+
+static inline size_t slab_bytes(slab_pool *pool) {
+    return pool->nchunks * SLAB_CHUNK_SIZE;
+}
+
+// Size-classed arena for variable-sized objects. Anything above the largest
+// class goes to malloc, but is still tracked so slab_arena_release() can
+// drop it together with the chunks.
+#define SLAB_CLASSES 9
+static const size_t slab_class_size[SLAB_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256,
+};
+
+typedef struct slab_large {
+    struct slab_large *prev, *next;
+    size_t size;
+} slab_large;
+
+typedef struct slab_arena {
+    slab_pool pools[SLAB_CLASSES];
+    slab_large *large;
+    size_t large_bytes;
+} slab_arena;
+
+static inline void slab_arena_init(slab_arena *arena) {
+    int i;
+    for(i = 0; i < SLAB_CLASSES; i++) {
+        slab_init(&arena->pools[i], slab_class_size[i]);
+    }
+    arena->large = NULL;
+    arena->large_bytes = 0;
+}
+
+static inline int slab_class(size_t size) {
+    int i;
+    for(i = 0; i < SLAB_CLASSES; i++) {
+        if(size <= slab_class_size[i])
+            return i;
+    }
+    return -1;
+}
+
+static inline void *slab_arena_alloc(slab_arena *arena, size_t size) {
+    int cls = slab_class(size);
+    if(cls >= 0)
+        return slab_alloc(&arena->pools[cls]);
+
+    slab_large *large = malloc(sizeof(slab_large) + size);
+    if(!large)
+        return NULL;
+
+    large->prev = NULL;
+    large->next = arena->large;
+    large->size = size;
+    if(arena->large)
+        arena->large->prev = large;
+    arena->large = large;
+    arena->large_bytes += size;
+
+    return large + 1;
+}
+
+static inline void slab_arena_free(slab_arena *arena, void *p, size_t size) {
+    int cls = slab_class(size);
+    if(cls >= 0) {
+        slab_free(&arena->pools[cls], p);
+        return;
+    }
+
+    slab_large *large = (slab_large *)p - 1;
+    if(large->prev)
+        large->prev->next = large->next;
+    else
+        arena->large = large->next;
+    if(large->next)
+        large->next->prev = large->prev;
+    arena->large_bytes -= large->size;
+
+    free(large);
+}
+
+static inline void slab_arena_release(slab_arena *arena) {
+    int i;
+    for(i = 0; i < SLAB_CLASSES; i++) {
+        slab_release(&arena->pools[i]);
+    }
+
+    slab_large *large = arena->large;
+    while(large) {
+        slab_large *next = large->next;
+        free(large);
+        large = next;
+    }
+    arena->large = NULL;
+    arena->large_bytes = 0;
+}
+
+static inline void slab_arena_adopt(slab_arena *arena, slab_arena *from) {
+    int i;
+    for(i = 0; i < SLAB_CLASSES; i++) {
+        slab_adopt(&arena->pools[i], &from->pools[i]);
+    }
+
+    slab_large *large = from->large;
+    while(large) {
+        slab_large *next = large->next;
+        large->prev = NULL;
+        large->next = arena->large;
+        if(arena->large)
+            arena->large->prev = large;
+        arena->large = large;
+        large = next;
+    }
+    arena->large_bytes += from->large_bytes;
+    from->large = NULL;
+    from->large_bytes = 0;
+}
+
+static inline size_t slab_arena_bytes(slab_arena *arena) {
+    size_t bytes = arena->large_bytes;
+    int i;
+    for(i = 0; i < SLAB_CLASSES; i++) {
+        bytes += slab_bytes(&arena->pools[i]);
+    }
+    return bytes;
+}
+
+#endif
@@ -0,0 +1,231 @@
+// Bit vectors with rank and select, and arrays of packed integers
+
+#ifndef SUCCINCT_H
+#define SUCCINCT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The number of ones before every block of RANK_BLOCK bits is kept next to
+// the bits, so rank is a lookup and a few popcounts. Select starts from the
+// position of every SELECT_SAMPLE-th one and scans forward.
+#define RANK_BLOCK 512
+#define SELECT_SAMPLE 512
+
+typedef struct bitvec {
+    uint64_t *words;
+    size_t nbits;
+    uint64_t *ranks;
+    uint64_t *samples;
+    size_t ones;
+} bitvec;
+
+#define BITVEC_WORDS(nbits) (((nbits) + 63) / 64)
+
+static inline int bitvec_init(bitvec *bv, size_t nbits) {
+    memset(bv, 0, sizeof(*bv));
+    bv->nbits = nbits;
+    bv->words = calloc(BITVEC_WORDS(nbits) + 1, sizeof(uint64_t));
+    return !bv->words;
+}
+
+static inline void bitvec_set(bitvec *bv, size_t i) {
+    bv->words[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline int bitvec_get(const bitvec *bv, size_t i) {
+    return (bv->words[i / 64] >> (i % 64)) & 1;
+}
+
+// builds the rank and select directories once every bit is set
+static inline int bitvec_index(bitvec *bv) {
+    size_t nwords = BITVEC_WORDS(bv->nbits);
+    size_t nblocks = nwords / (RANK_BLOCK / 64) + 1;
+    bv->ranks = malloc(nblocks * sizeof(uint64_t));
+    if(!bv->ranks)
+        return 1;
+
+    size_t i, ones = 0;
+    for(i = 0; i < nwords; i++) {
+        if(i % (RANK_BLOCK / 64) == 0)
+            bv->ranks[i / (RANK_BLOCK / 64)] = ones;
+        ones += __builtin_popcountll(bv->words[i]);
+    }
+    if(nwords % (RANK_BLOCK / 64) == 0)
+        bv->ranks[nwords / (RANK_BLOCK / 64)] = ones;
+    bv->ones = ones;
+
+    bv->samples = malloc((ones / SELECT_SAMPLE + 1) * sizeof(uint64_t));
+    if(!bv->samples)
+        return 1;
+    size_t seen = 0;
+    for(i = 0; i < nwords; i++) {
+        uint64_t word = bv->words[i];
+        size_t n = __builtin_popcountll(word);
+        size_t next = (seen + SELECT_SAMPLE - 1) / SELECT_SAMPLE * SELECT_SAMPLE;
+        for(; next < seen + n; next += SELECT_SAMPLE) {
+            uint64_t w = word;
+            size_t k = next - seen;
+            while(k--)
+                w &= w - 1;
+            bv->samples[next / SELECT_SAMPLE] = i * 64 + __builtin_ctzll(w);
+        }
+        seen += n;
+    }
+    return 0;
+}
+
+static inline void bitvec_free(bitvec *bv) {
+    free(bv->words);
+    free(bv->ranks);
+    free(bv->samples);
+    memset(bv, 0, sizeof(*bv));
+}
+
+static inline size_t bitvec_bytes(const bitvec *bv) {
+    return (BITVEC_WORDS(bv->nbits) + 1) * sizeof(uint64_t) +
+        (BITVEC_WORDS(bv->nbits) / (RANK_BLOCK / 64) + 1) * sizeof(uint64_t) +
+        (bv->ones / SELECT_SAMPLE + 1) * sizeof(uint64_t);
+}
+
+// ones before position i
+static inline size_t bitvec_rank1(const bitvec *bv, size_t i) {
+    size_t word = i / 64;
+    size_t w = word / (RANK_BLOCK / 64) * (RANK_BLOCK / 64);
+    size_t ones = bv->ranks[i / RANK_BLOCK];
+    for(; w < word; w++)
+        ones += __builtin_popcountll(bv->words[w]);
+    if(i % 64)
+        ones += __builtin_popcountll(bv->words[word] << (64 - i % 64));
+    return ones;
+}
+
+// position of the one with rank k, which must exist
+static inline size_t bitvec_select1(const bitvec *bv, size_t k) {
+    size_t pos = bv->samples[k / SELECT_SAMPLE];
+    k %= SELECT_SAMPLE;
+    size_t word = pos / 64;
+    uint64_t w = bv->words[word] & (~(uint64_t)0 << (pos % 64));
+    for(;;) {
+        size_t n = __builtin_popcountll(w);
+        if(k < n)
+            break;
+        k -= n;
+        w = bv->words[++word];
+    }
+    while(k--)
+        w &= w - 1;
+    return word * 64 + __builtin_ctzll(w);
+}
+
+// position of the first one at or after i. the vector must have one there
+static inline size_t bitvec_next1(const bitvec *bv, size_t i) {
+    size_t word = i / 64;
+    uint64_t w = bv->words[word] & (~(uint64_t)0 << (i % 64));
+    while(!w)
+        w = bv->words[++word];
+    return word * 64 + __builtin_ctzll(w);
+}
+
+// Integers of width bits each, 0 to 64. A spare word at the end lets every
+// read and write touch two words without checking.
+typedef struct packed_ints {
+    uint64_t *words;
+    size_t n;
+    int width;
+} packed_ints;
+
+static inline int bits_needed(uint64_t max) {
+    return max ? 64 - __builtin_clzll(max) : 0;
+}
+
+static inline int packed_init(packed_ints *a, size_t n, int width) {
+    a->n = n;
+    a->width = width;
+    a->words = calloc(BITVEC_WORDS(n * width) + 1, sizeof(uint64_t));
+    return !a->words;
+}
+
+static inline uint64_t packed_mask(int width) {
+    return width == 64 ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+}
+
+static inline void packed_set(packed_ints *a, size_t i, uint64_t value) {
+    if(!a->width)
+        return;
+    size_t bit = i * a->width;
+    uint64_t *w = &a->words[bit / 64];
+    int shift = bit % 64;
+    w[0] |= value << shift;
+    if(shift + a->width > 64)
+        w[1] |= value >> (64 - shift);
+}
+
+static inline uint64_t packed_get(const packed_ints *a, size_t i) {
+    if(!a->width)
+        return 0;
+    size_t bit = i * a->width;
+    const uint64_t *w = &a->words[bit / 64];
+    int shift = bit % 64;
+    uint64_t value = w[0] >> shift;
+    if(shift + a->width > 64)
+        value |= w[1] << (64 - shift);
+    return value & packed_mask(a->width);
+}
+
+static inline void packed_free(packed_ints *a) {
+    free(a->words);
+    a->words = NULL;
+}
+
+static inline size_t packed_bytes(const packed_ints *a) {
+    return (BITVEC_WORDS(a->n * a->width) + 1) * sizeof(uint64_t);
+}
+
+// Elias-Fano coding of a non-decreasing sequence: the low bits of every
+// value are packed, the high bits are stored in unary in a bit vector.
+// Takes about 2 + log(max / n) bits per value.
+typedef struct elias_fano {
+    bitvec high;
+    packed_ints low;
+} elias_fano;
+
+// values must be non-decreasing, the last one being the largest
+static inline int ef_init(elias_fano *ef, const uint64_t *values, size_t n) {
+    uint64_t max = n ? values[n - 1] : 0;
+    int width = n && max / n ? bits_needed(max / n) - 1 : 0;
+    if(bitvec_init(&ef->high, (max >> width) + n + 1) || packed_init(&ef->low, n, width))
+        return 1;
+
+    size_t i;
+    for(i = 0; i < n; i++) {
+        bitvec_set(&ef->high, (values[i] >> width) + i);
+        packed_set(&ef->low, i, values[i] & packed_mask(width));
+    }
+    return bitvec_index(&ef->high);
+}
+
+static inline uint64_t ef_get(const elias_fano *ef, size_t i) {
+    size_t high = bitvec_select1(&ef->high, i) - i;
+    return (uint64_t)high << ef->low.width | packed_get(&ef->low, i);
+}
+
+// values i and i + 1, for a single select
+static inline void ef_get_pair(const elias_fano *ef, size_t i, uint64_t *a, uint64_t *b) {
+    size_t pos = bitvec_select1(&ef->high, i);
+    size_t next = bitvec_next1(&ef->high, pos + 1);
+    *a = (uint64_t)(pos - i) << ef->low.width | packed_get(&ef->low, i);
+    *b = (uint64_t)(next - i - 1) << ef->low.width | packed_get(&ef->low, i + 1);
+}
+
+static inline void ef_free(elias_fano *ef) {
+    bitvec_free(&ef->high);
+    packed_free(&ef->low);
+}
+
+static inline size_t ef_bytes(const elias_fano *ef) {
+    return bitvec_bytes(&ef->high) + packed_bytes(&ef->low);
+}
+
+#endif